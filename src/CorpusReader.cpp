@@ -0,0 +1,321 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "CorpusReader.hpp"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+using namespace std;
+
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+/* Minimal io_uring plumbing over the raw system calls: one submission and one completion
+ * queue, mapped from the kernel. Only this class touches the ring memory. */
+struct CorpusReader::Ring
+{
+	int fd;
+	void* sqMap;
+	void* cqMap;
+	size_t sqMapSize, cqMapSize, sqesSize;
+
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	io_uring_sqe* sqes;
+	io_uring_cqe* cqes;
+	unsigned queued;
+
+	/* Returns NULL if the kernel does not let us set up a ring. */
+	static Ring* create(unsigned entries)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+
+		int fd = syscall(__NR_io_uring_setup, entries, &params);
+		if (fd < 0)
+			return NULL;
+
+		Ring* ring = new Ring();
+		ring->fd = fd;
+		ring->queued = 0;
+		ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+		bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single)
+			ring->sqMapSize = ring->cqMapSize = max(ring->sqMapSize, ring->cqMapSize);
+
+		ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE,
+						   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		ring->cqMap = single ? ring->sqMap :
+			mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		void* sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+						  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+		if (ring->sqMap == MAP_FAILED || ring->cqMap == MAP_FAILED || sqes == MAP_FAILED)
+		{
+			if (sqes != MAP_FAILED)
+				ring->sqes = static_cast<io_uring_sqe*>(sqes);
+			else
+				ring->sqesSize = 0;
+			delete ring;
+			return NULL;
+		}
+
+		char* sq = static_cast<char*>(ring->sqMap);
+		char* cq = static_cast<char*>(ring->cqMap);
+		ring->sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		ring->sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		ring->sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		ring->sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		ring->cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		ring->cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		ring->cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+		ring->sqes = static_cast<io_uring_sqe*>(sqes);
+
+		return ring;
+	}
+
+	Ring() : fd(-1), sqMap(MAP_FAILED), cqMap(MAP_FAILED), sqesSize(0), sqes(NULL) {}
+
+	~Ring()
+	{
+		if (sqesSize)
+			munmap(sqes, sqesSize);
+		if (cqMap != MAP_FAILED && cqMap != sqMap)
+			munmap(cqMap, cqMapSize);
+		if (sqMap != MAP_FAILED)
+			munmap(sqMap, sqMapSize);
+		if (fd >= 0)
+			close(fd);
+	}
+
+	/* Queues a read; it is handed to the kernel by the next enter(). */
+	void read(int file, char* buffer, unsigned length, uint64_t offset, uint64_t tag)
+	{
+		unsigned tail = *sqTail;
+		unsigned index = tail & *sqMask;
+
+		io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = file;
+		sqe->addr = reinterpret_cast<uint64_t>(buffer);
+		sqe->len = length;
+		sqe->off = offset;
+		sqe->user_data = tag;
+
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		++queued;
+	}
+
+	/* Submits queued reads and waits for at least wait completions. */
+	void enter(unsigned wait)
+	{
+		int ret = syscall(__NR_io_uring_enter, fd, queued, wait,
+						  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (ret < 0 && errno != EINTR)
+			throw runtime_error(string("io_uring_enter failed: ") + strerror(errno));
+		if (ret > 0)
+			queued -= ret;
+	}
+
+	bool complete(uint64_t& tag, int& result)
+	{
+		unsigned head = *cqHead;
+		if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+			return false;
+
+		const io_uring_cqe* cqe = &cqes[head & *cqMask];
+		tag = cqe->user_data;
+		result = cqe->res;
+		__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+};
+
+#else
+
+struct CorpusReader::Ring
+{
+	unsigned queued;
+
+	static Ring* create(unsigned) { return NULL; }
+	void read(int, char*, unsigned, uint64_t, uint64_t) {}
+	void enter(unsigned) {}
+	bool complete(uint64_t&, int&) { return false; }
+};
+
+#endif
+
+
+/* Completion tags pack the file index and the read's offset into the file. Offsets are
+ * limited to 40 bits (1 TiB) and files to 2^24 per reader. */
+static const int OFFSET_BITS = 40;
+
+CorpusReader::CorpusReader(const vector<string>& filenames, size_t depth, size_t chunkSize)
+	: _depth(max<size_t>(depth, 1)), _chunkSize(max<size_t>(chunkSize, 4096)),
+	  _nextOut(0), _nextOpen(0), _inFlight(0), _ring(NULL)
+{
+	for (auto name : filenames)
+	{
+		File file;
+		file.name = name;
+		file.fd = -1;
+		file.submitted = file.completed = 0;
+		_files.push_back(file);
+	}
+
+	if (_files.size() < (size_t(1) << (64 - OFFSET_BITS)))
+		_ring = Ring::create(_depth);
+}
+
+
+CorpusReader::~CorpusReader()
+{
+	/* Wait out reads still in flight before their buffers go away. */
+	try
+	{
+		while (_inFlight)
+			reap();
+	}
+	catch (...)
+	{
+	}
+	delete _ring;
+
+	for (auto& file : _files)
+		if (file.fd >= 0)
+			close(file.fd);
+}
+
+
+bool CorpusReader::next(string& filename, string& contents)
+{
+	if (_nextOut == _files.size())
+		return false;
+
+	File& file = _files[_nextOut];
+
+	if (!_ring)
+	{
+		ifstream in(file.name, ios::binary);
+		if (!in.is_open())
+			throw runtime_error("file not found: " + file.name);
+
+		ostringstream buffer;
+		buffer << in.rdbuf();
+		filename = file.name;
+		contents = buffer.str();
+		++_nextOut;
+		return true;
+	}
+
+	fill();
+	while (file.fd < 0 || file.completed != file.data.size())
+	{
+		reap();
+		fill();
+	}
+
+	filename = file.name;
+	contents.swap(file.data);
+	close(file.fd);
+	file.fd = -1;
+	++_nextOut;
+
+	/* Keep the device busy while the caller works on this file. */
+	fill();
+	return true;
+}
+
+
+void CorpusReader::fill()
+{
+	while (_inFlight < _depth)
+	{
+		/* Continue the oldest file with unread bytes, or open the next one. */
+		size_t i = _nextOut;
+		while (i < _nextOpen && _files[i].submitted == _files[i].data.size())
+			++i;
+
+		if (i == _nextOpen)
+		{
+			if (_nextOpen == _files.size() || _nextOpen - _nextOut >= _depth)
+				break;
+
+			File& file = _files[_nextOpen];
+			file.fd = open(file.name.c_str(), O_RDONLY | O_CLOEXEC);
+			if (file.fd < 0)
+				throw runtime_error("file not found: " + file.name);
+
+			struct stat st;
+			if (fstat(file.fd, &st) != 0)
+				throw runtime_error("cannot read file: " + file.name);
+
+			file.data.resize(st.st_size);
+			++_nextOpen;
+			continue;
+		}
+
+		File& file = _files[i];
+		size_t length = min(_chunkSize, file.data.size() - file.submitted);
+		submit(i, file.submitted, length);
+		file.submitted += length;
+	}
+
+	if (_ring->queued)
+		_ring->enter(0);
+}
+
+
+void CorpusReader::submit(size_t file, size_t offset, size_t length)
+{
+	uint64_t tag = (uint64_t(file) << OFFSET_BITS) | offset;
+	_ring->read(_files[file].fd, &_files[file].data[offset], length, offset, tag);
+	++_inFlight;
+}
+
+
+void CorpusReader::reap()
+{
+	uint64_t tag;
+	int result;
+
+	if (!_ring->complete(tag, result))
+	{
+		_ring->enter(1);
+		return;
+	}
+	--_inFlight;
+
+	size_t i = tag >> OFFSET_BITS;
+	size_t offset = tag & ((uint64_t(1) << OFFSET_BITS) - 1);
+	File& file = _files[i];
+
+	if (result < 0)
+		throw runtime_error("cannot read file: " + file.name + ": " + strerror(-result));
+
+	/* Reads may come back short; queue the rest of the chunk again. Chunks start at multiples
+	 * of the chunk size. */
+	size_t length = min((offset / _chunkSize + 1) * _chunkSize, file.data.size()) - offset;
+	if (result == 0 && length != 0)
+		throw runtime_error("file shrank while reading: " + file.name);
+	if (size_t(result) < length)
+		submit(i, offset + result, length - result);
+
+	file.completed += result;
+}
@@ -0,0 +1,55 @@
+#ifndef GUARD_CORPUSREADER_HPP
+#define GUARD_CORPUSREADER_HPP
+
+#include <string>
+#include <vector>
+
+
+/*
+ * Reads a list of corpus files ahead of the caller. On Linux the reads are issued through
+ * io_uring, keeping up to depth reads of chunkSize bytes in flight across files so that the
+ * device stays busy while the caller parses and scores; elsewhere, or if io_uring is not
+ * available, each file is read when it is asked for. Files are handed out in list order.
+ */
+class CorpusReader
+{
+public:
+	CorpusReader(const std::vector<std::string>& filenames, size_t depth = 64,
+				 size_t chunkSize = 1 << 20);
+	~CorpusReader();
+
+	/**
+	 * Returns the next file's name and contents, or false once all files have been read.
+	 * Throws if a file cannot be opened or read.
+	 */
+	bool next(std::string& filename, std::string& contents);
+
+	/** Whether reads are issued asynchronously. */
+	bool asynchronous() const { return _ring != NULL; }
+
+private:
+	struct File
+	{
+		std::string name;
+		int fd;
+		std::string data;
+		size_t submitted, completed;
+	};
+	struct Ring;
+
+	CorpusReader(const CorpusReader&);
+	CorpusReader& operator=(const CorpusReader&);
+
+	void fill();
+	void reap();
+	void submit(size_t file, size_t offset, size_t length);
+
+private:
+	std::vector<File> _files;
+	size_t _depth, _chunkSize;
+	size_t _nextOut, _nextOpen, _inFlight;
+	Ring* _ring;
+};
+
+
+#endif
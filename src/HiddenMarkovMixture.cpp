@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include "HiddenMarkovMixture.hpp"
+#include "PerfCounters.hpp"
+
+using namespace std;
+
+
+/* Expected counts of one EM pass: a set per component, plus the summed responsibilities that
+ * become the component weights. */
+struct HiddenMarkovMixture::Stats
+{
+	Stats(size_t K, size_t N, size_t M)
+		: components(K, BaumWelchStats(N, M)), responsibility(K), logLikelihood(0)
+	{
+	}
+
+	void merge(const Stats& other)
+	{
+		for (size_t k = 0; k < components.size(); ++k)
+		{
+			components[k].merge(other.components[k]);
+			responsibility[k] += other.responsibility[k];
+		}
+		logLikelihood += other.logLikelihood;
+	}
+
+	vector<BaumWelchStats> components;
+	vector<double> responsibility;
+	double logLikelihood;
+};
+
+
+HiddenMarkovMixture::HiddenMarkovMixture(const HiddenMarkovModel& model, size_t count,
+										 unsigned long seed)
+{
+	if (count == 0)
+		throw runtime_error("a mixture needs at least one component");
+
+	size_t N = model.states().size(), M = model.outputs().size();
+	mt19937_64 rng(seed);
+	uniform_real_distribution<double> jitter(0.5, 1.5);
+
+	/* maximize() renormalizes the perturbed rows into the component's parameters. */
+	for (size_t k = 0; k < count; ++k)
+	{
+		BaumWelchStats params(N, M);
+		for (size_t i = 0; i < N*N; ++i)
+			params.transitions[i] = model._a[i] * jitter(rng);
+		for (size_t i = 0; i < N*M; ++i)
+			params.emissions[i] = model._b[i] * jitter(rng);
+		for (size_t i = 0; i < N; ++i)
+			params.initial[i] = model._pi[i] * jitter(rng);
+
+		_components.push_back(model);
+		_components.back().maximize(params);
+	}
+
+	_weights.assign(count, 1.0 / count);
+}
+
+
+/* Fills ll with log(weight) + log P(obs | component) for each component. */
+void HiddenMarkovMixture::componentLogLikelihoods(const vector<int>& obs,
+												  HugePageVector<double>& scratch,
+												  vector<double>& ll) const
+{
+	ll.resize(_components.size());
+	for (size_t k = 0; k < _components.size(); ++k)
+		ll[k] = log(_weights[k]) + _components[k].forwardPass(obs, scratch);
+}
+
+
+/* Turns the weighted component log-likelihoods of a sequence into its responsibilities, in
+ * place, and returns the mixture log-likelihood of the sequence. */
+double HiddenMarkovMixture::responsibilities(vector<double>& ll) const
+{
+	double top = *max_element(ll.begin(), ll.end());
+	if (top == -numeric_limits<double>::infinity())
+	{
+		fill(ll.begin(), ll.end(), 0.0);
+		return top;
+	}
+
+	double sum = 0;
+	for (auto& x : ll)
+	{
+		x = exp(x - top);
+		sum += x;
+	}
+	for (auto& x : ll)
+		x /= sum;
+
+	return top + log(sum);
+}
+
+
+/* Hands out the indices of a batch to workers in small chunks. */
+static const size_t CHUNK = 16;
+
+vector<double> HiddenMarkovMixture::responsibilities(const vector<vector<int> >& corpus,
+													 const ExecutionPolicy& policy) const
+{
+	size_t K = _components.size();
+	vector<double> ret(corpus.size() * K);
+	ProgressMeter meter(policy, corpus.size());
+	atomic<size_t> next(0);
+
+	runWorkers(policy, [&](unsigned) {
+		HugePageVector<double> scratch;
+		vector<double> ll;
+		CounterScope counters("mixture-score");
+
+		for (size_t begin; (begin = next.fetch_add(CHUNK)) < corpus.size(); )
+		{
+			for (size_t i = begin; i < min(begin + CHUNK, corpus.size()); ++i)
+			{
+				componentLogLikelihoods(corpus[i], scratch, ll);
+				responsibilities(ll);
+				copy(ll.begin(), ll.end(), ret.begin() + i*K);
+				meter.advance(1);
+			}
+		}
+	});
+
+	meter.finish();
+	return ret;
+}
+
+
+vector<size_t> HiddenMarkovMixture::assign(const vector<vector<int> >& corpus,
+										   const ExecutionPolicy& policy) const
+{
+	size_t K = _components.size();
+	vector<double> resp = responsibilities(corpus, policy);
+	vector<size_t> ret(corpus.size(), K);
+
+	for (size_t i = 0; i < corpus.size(); ++i)
+	{
+		auto row = resp.begin() + i*K;
+		auto best = max_element(row, row + K);
+		if (*best > 0)
+			ret[i] = best - row;
+	}
+
+	return ret;
+}
+
+
+double HiddenMarkovMixture::train(const vector<vector<int> >& corpus,
+								  const TrainingOptions& options)
+{
+	size_t K = _components.size(), N = _components[0].states().size();
+	size_t M = _components[0].outputs().size();
+	double logLikelihood = -numeric_limits<double>::infinity();
+	size_t iteration = 0;
+
+	/* Tag the E-step's progress reports with the iteration and the last likelihood. */
+	ExecutionPolicy pass = options.execution;
+	if (options.execution.progress)
+	{
+		pass.progress = [&](const Progress& progress) {
+			Progress tagged = progress;
+			tagged.iteration = iteration;
+			tagged.logLikelihood = logLikelihood;
+			options.execution.progress(tagged);
+		};
+	}
+
+	/* Each worker keeps the forward trellis of every component, and one backward trellis. */
+	unsigned workers = options.execution.workers();
+	vector<vector<HugePageVector<double> > > alpha(workers, vector<HugePageVector<double> >(K));
+	vector<vector<vector<double> > > scale(workers, vector<vector<double> >(K));
+	vector<HugePageVector<double> > beta(workers);
+	vector<vector<double> > resp(workers), componentLL(workers), weighted(workers);
+
+	/* Runs the forward pass of sequence i once per component, which gives both its
+	 * responsibilities and the forward half of each component's E-step, then the backward
+	 * pass of the components that are responsible for it, and weights their counts. */
+	auto add = [&](unsigned worker, size_t i, Stats& stats) {
+		const vector<int>& obs = corpus[i];
+		vector<double>& r = resp[worker];
+		vector<double>& ll = componentLL[worker];
+		ll.resize(K);
+		for (size_t k = 0; k < K; ++k)
+			ll[k] = _components[k].forwardTrellis(obs, alpha[worker][k], scale[worker][k]);
+
+		r.resize(K);
+		for (size_t k = 0; k < K; ++k)
+			r[k] = log(_weights[k]) + ll[k];
+		double total = responsibilities(r);
+		if (total == -numeric_limits<double>::infinity())
+			return;
+
+		stats.logLikelihood += total;
+		for (size_t k = 0; k < K; ++k)
+		{
+			if (r[k] == 0)
+				continue;
+
+			stats.responsibility[k] += r[k];
+			if (obs.empty())
+				continue;
+
+			BaumWelchStats& counts = stats.components[k];
+			_components[k].backwardPass(obs, scale[worker][k], beta[worker]);
+			_components[k].addExpectedCounts(obs, alpha[worker][k], beta[worker],
+											 scale[worker][k], r[k], counts, weighted[worker]);
+			counts.logLikelihood += r[k] * ll[k];
+			++counts.sequences;
+		}
+	};
+
+	for (iteration = 1; iteration <= options.iterations; ++iteration)
+	{
+		if (options.execution.cancelled())
+			throw Cancelled();
+
+		Stats stats = reduceItems<Stats>(corpus.size(), pass, options.deterministic,
+			options.shardSize, "mixture", [&] { return Stats(K, N, M); }, add);
+
+		/* Re-estimate the components on the workers; accumulate() leaves the transition
+		 * probabilities out of the expected transitions. */
+		atomic<size_t> next(0);
+		runWorkers(options.execution, [&](unsigned) {
+			for (size_t k; (k = next.fetch_add(1)) < K; )
+			{
+				BaumWelchStats& counts = stats.components[k];
+				for (size_t j = 0; j < N*N; ++j)
+					counts.transitions[j] *= _components[k]._a[j];
+				_components[k].maximize(counts);
+			}
+		});
+
+		double total = 0;
+		for (size_t k = 0; k < K; ++k)
+			total += stats.responsibility[k];
+		for (size_t k = 0; k < K && total > 0; ++k)
+			_weights[k] = stats.responsibility[k] / total;
+
+		logLikelihood = stats.logLikelihood;
+	}
+
+	return logLikelihood;
+}
+
+
+void HiddenMarkovMixture::save(const string& filename) const
+{
+	string stem = filename;
+	if (stem.size() >= 4 && stem.compare(stem.size() - 4, 4, ".hmm") == 0)
+		stem.erase(stem.size() - 4);
+
+	for (size_t k = 0; k < _components.size(); ++k)
+		_components[k].save(stem + "." + to_string(k) + ".hmm");
+}
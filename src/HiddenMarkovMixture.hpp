@@ -0,0 +1,70 @@
+#ifndef GUARD_HMMMIXTURE_HPP
+#define GUARD_HMMMIXTURE_HPP
+
+#include <string>
+#include <vector>
+#include "HiddenMarkovModel.hpp"
+
+
+/*
+ * Mixture of HMMs for clustering sequences: a sequence is drawn from component k with
+ * probability weights()[k]. Training is EM over sequence-to-component responsibilities, and
+ * every pass over the corpus handles all components at once: each sequence is scored by every
+ * component and then adds its expected counts to each component, weighted by its
+ * responsibility. All components share the output vocabulary of the first one.
+ */
+class HiddenMarkovMixture
+{
+public:
+	/**
+	 * Starts a mixture of count components with equal weights. Each component is the given
+	 * model with every parameter row randomly perturbed, from a generator seeded with seed, so
+	 * that the components can tell sequences apart.
+	 */
+	HiddenMarkovMixture(const HiddenMarkovModel& model, size_t count, unsigned long seed = 0);
+
+	size_t size() const { return _components.size(); }
+	const HiddenMarkovModel& component(size_t k) const { return _components[k]; }
+	const std::vector<double>& weights() const { return _weights; }
+
+	/**
+	 * Returns the responsibilities P(component k | sequence i) as a row-major matrix with one
+	 * row of size() values per sequence. Rows of sequences no component can produce are zero.
+	 */
+	std::vector<double> responsibilities(const std::vector<std::vector<int> >& corpus,
+										 const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Returns the most responsible component of each sequence, or size() if no component can
+	 * produce it.
+	 */
+	std::vector<size_t> assign(const std::vector<std::vector<int> >& corpus,
+							   const ExecutionPolicy& policy = ExecutionPolicy()) const;
+
+	/**
+	 * Runs EM iterations over a corpus interned with the shared vocabulary and returns the
+	 * mixture log-likelihood of the corpus before the last re-estimation. Throws Cancelled if
+	 * the job is cancelled; the mixture then holds the parameters of the last completed
+	 * iteration.
+	 */
+	double train(const std::vector<std::vector<int> >& corpus,
+				 const TrainingOptions& options = TrainingOptions());
+
+	/**
+	 * Writes component k to <stem>.<k>.hmm, where filename is <stem>.hmm.
+	 */
+	void save(const std::string& filename) const;
+
+private:
+	struct Stats;
+
+	void componentLogLikelihoods(const std::vector<int>&, HugePageVector<double>&,
+								 std::vector<double>&) const;
+	double responsibilities(std::vector<double>&) const;
+
+private:
+	std::vector<HiddenMarkovModel> _components;
+	std::vector<double> _weights;
+};
+
+
+#endif
@@ -1,13 +1,30 @@
 #include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <fstream>
+#include <random>
 #include <iostream>
 #include <limits>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 #include "HiddenMarkovModel.hpp"
+#include "PerfCounters.hpp"
+#include "ResultFile.hpp"
 #include "Utils.hpp"
 
 using namespace std;
 
 
+Vocabulary::Vocabulary(const vector<string>& outputNames)
+	: names(outputNames)
+{
+	for (size_t k = 0; k < names.size(); ++k)
+		ids[names[k]] = k;
+}
+
+
 HiddenMarkovModel::HiddenMarkovModel(const string& filename)
 {
 	ifstream file(filename);
@@ -40,7 +57,7 @@ HiddenMarkovModel::HiddenMarkovModel(const string& filename)
 	getline(file, line);
 	vector<string> outputNames = split<string>(line);
 	// initialize all output symbols
-	_outputNames = outputNames;
+	_vocabulary = make_shared<Vocabulary>(outputNames);
 
 	// consume "a:"
 	file.ignore(numeric_limits<streamsize>::max(), '\n');
@@ -81,6 +98,78 @@ HiddenMarkovModel::HiddenMarkovModel(const string& filename)
 	{
 		_initStates[*i] = tmp[col++];
 	}
+
+	/* Keep dense copies of the parameters for the interned engines. */
+	size_t N = _stateNames.size(), M = outputNames.size();
+	_a.resize(N*N);
+	_b.resize(N*M);
+	_pi.resize(N);
+
+	for (size_t i = 0; i < N; ++i)
+	{
+		for (size_t j = 0; j < N; ++j)
+			_a[i*N + j] = _transitions[_stateNames[i]][_stateNames[j]];
+		for (size_t k = 0; k < M; ++k)
+			_b[i*M + k] = _emissions[_stateNames[i]][outputNames[k]];
+		_pi[i] = _initStates[_stateNames[i]];
+	}
+	updateLogTables();
+}
+
+
+/* Precomputes the logarithms of the dense parameters, so that log() stays out of the inner
+ * loops of the log-space engines, and drops the node replicas of the old parameters. */
+void HiddenMarkovModel::updateLogTables()
+{
+	_replicas.clear();
+	_logA.resize(_a.size());
+	_logB.resize(_b.size());
+	_logPi.resize(_pi.size());
+
+	transform(_a.begin(), _a.end(), _logA.begin(), [](double p) { return log(p); });
+	transform(_b.begin(), _b.end(), _logB.begin(), [](double p) { return log(p); });
+	transform(_pi.begin(), _pi.end(), _logPi.begin(), [](double p) { return log(p); });
+}
+
+
+HiddenMarkovModel HiddenMarkovModel::random(size_t states,
+											 const shared_ptr<const Vocabulary>& vocabulary,
+											 size_t timeSteps, unsigned long seed)
+{
+	HiddenMarkovModel ret;
+	ret._numOfTimeSteps = timeSteps;
+	ret._vocabulary = vocabulary;
+	for (size_t i = 0; i < states; ++i)
+		ret._stateNames.push_back("S" + to_string(i));
+
+	size_t N = states, M = vocabulary->names.size();
+	ret._a.resize(N*N);
+	ret._b.resize(N*M);
+	ret._pi.resize(N);
+
+	/* Rows are kept away from zero, so that training can move every parameter. maximize()
+	 * normalizes them and fills in the string keyed maps. */
+	mt19937_64 rng(seed);
+	uniform_real_distribution<double> uniform(0.1, 1.0);
+	BaumWelchStats params(N, M);
+	for (auto& p : params.transitions)
+		p = uniform(rng);
+	for (auto& p : params.emissions)
+		p = uniform(rng);
+	for (auto& p : params.initial)
+		p = uniform(rng);
+
+	ret.maximize(params);
+	return ret;
+}
+
+
+void HiddenMarkovModel::shareVocabulary(const shared_ptr<const Vocabulary>& vocabulary)
+{
+	if (vocabulary->names != _vocabulary->names)
+		throw runtime_error("cannot share a different vocabulary");
+
+	_vocabulary = vocabulary;
 }
 
 
@@ -146,6 +235,59 @@ double HiddenMarkovModel::eval(const vector<string>& out, const vector<string>&
 }
 
 
+vector<double> HiddenMarkovModel::scorePaths(const vector<int>& obs,
+											 const vector<vector<int> >& paths) const
+{
+	size_t N = _stateNames.size(), M = outputs().size(), T = obs.size();
+	vector<double> ret(paths.size(), -numeric_limits<double>::infinity());
+	CounterScope counters("paths");
+
+	/* Gather the emission log probabilities of each position once, so that scoring a trie node
+	 * reads one contiguous row instead of striding through the emission matrix. */
+	vector<double> emit(T*N);
+	for (size_t t = 0; t < T; ++t)
+		for (size_t s = 0; s < N; ++s)
+			emit[t*N + s] = _logB[s*M + obs[t]];
+
+	vector<size_t> order;
+	for (size_t p = 0; p < paths.size(); ++p)
+	{
+		if (paths[p].size() != T)
+			continue;
+
+		for (auto stt : paths[p])
+			if (stt < 0 || size_t(stt) >= N)
+				throw runtime_error("No such state ID: " + to_string(stt));
+		order.push_back(p);
+	}
+
+	/* Each path is inserted once into the trie of all paths, in input order, and only scores
+	 * the positions past the longest prefix already in it. Node 0 is the empty prefix; the
+	 * child of node n for state s is found under n*N + s, and score[n] is the log probability
+	 * of the prefix ending at n. */
+	vector<double> score(1, 0.0);
+	unordered_map<size_t, size_t> child;
+	for (auto p : order)
+	{
+		const vector<int>& path = paths[p];
+		size_t node = 0;
+		for (size_t t = 0; t < T; ++t)
+		{
+			auto inserted = child.insert(make_pair(node*N + path[t], score.size()));
+			if (inserted.second)
+			{
+				double step = (t == 0) ? _logPi[path[0]] : _logA[path[t-1]*N + path[t]];
+				score.push_back(score[node] + step + emit[t*N + path[t]]);
+			}
+			node = inserted.first->second;
+		}
+		ret[p] = score[node];
+	}
+
+	return ret;
+}
+
+
 #if 0
 /* Treat t as the time marker at each point in the observation sequence. */
 double HiddenMarkovModel::forwardHelper(const vector<string>& obs, int t, const string& curStt)
@@ -203,27 +345,14 @@ double HiddenMarkovModel::forwardHelper(const vector<string>& obs, int t, const
 	return emission(curStt, obs[t]) * sum;
 }
 
-vector<double> HiddenMarkovModel::forward(const string& filename)
+vector<double> HiddenMarkovModel::forward(const string& filename, const ExecutionPolicy& policy)
 {
 	/* Vector of observation sequences. */
 	vector<vector<string> > observations = parseObsFile(filename);
 	if (observations.empty())
 		throw runtime_error("observation file is empty");
 
-	vector<double> ret;
-
-	/* Iterate through each sequence of observations. */
-	for (auto obs : observations)
-	{
-		double sum = 0;
-
-		for (auto stt : _stateNames)
-			sum += forwardHelper(obs, obs.size()-1, stt);
-
-		ret.push_back(sum);
-	}
-
-	return ret;
+	return forward(intern(observations), policy);
 }
 
 
@@ -266,205 +395,1601 @@ vector<double> HiddenMarkovModel::backward(const string& filename)
 }
 
 
-/* I sincerely hope to God no one ever reads this function definition... Here is an example of the
- * C++ code you can except when translating from Python...
- * Code taken from: https://en.wikipedia.org/wiki/Viterbi_algorithm */
-pair<double, vector<string> > HiddenMarkovModel::viterbiHelper(const vector<string>& obs)
+vector<pair<double, vector<string> > > HiddenMarkovModel::viterbi(const string& filename,
+																	 const ExecutionPolicy& policy)
 {
-	map<int, map<string, double> > V;
-	map<string, vector<string> > path;
-	size_t t = 0;
+	vector<vector<string> > observations = parseObsFile(filename);
+	if (observations.empty())
+		throw runtime_error("observation file is empty");
 
-	/* Initialize base cases (t == 0) */
-	for (auto stt : _stateNames)
+	vector<pair<double, vector<string> > > ret;
+
+	/* Translate each state ID path back to state names. */
+	for (auto result : viterbi(intern(observations), policy))
+	{
+		vector<string> path;
+		for (auto stt : result.second)
+			path.push_back(_stateNames[stt]);
+
+		ret.push_back(make_pair(result.first, path));
+	}
+
+	return ret;
+}
+
+
+vector<int> HiddenMarkovModel::intern(const vector<string>& obs) const
+{
+	vector<int> ret;
+	ret.reserve(obs.size());
+
+	for (auto out : obs)
+	{
+		auto id = _vocabulary->ids.find(out);
+		if (id == _vocabulary->ids.end())
+			throw runtime_error("No such output: " + out);
+
+		ret.push_back(id->second);
+	}
+
+	return ret;
+}
+
+vector<vector<int> > HiddenMarkovModel::intern(const vector<vector<string> >& observations) const
+{
+	vector<vector<int> > ret;
+	ret.reserve(observations.size());
+
+	for (auto& obs : observations)
+		ret.push_back(intern(obs));
+
+	return ret;
+}
+
+
+vector<int> HiddenMarkovModel::internStates(const vector<string>& stt) const
+{
+	vector<int> ret;
+	ret.reserve(stt.size());
+
+	for (auto& name : stt)
 	{
-		V[0][stt] = initState(stt) * emission(stt, obs[0]);
+		auto id = find(_stateNames.begin(), _stateNames.end(), name);
+		if (id == _stateNames.end())
+			throw runtime_error("No such state: " + name);
 
-		vector<string> tmp = {stt};
-		path[stt] = tmp;
+		ret.push_back(id - _stateNames.begin());
 	}
 
-	/* Run Viterbi for t > 0. */
-	++t;
-	double curMaxProb = 0;
-	string curMaxStt;
+	return ret;
+}
+
 
-	while (t != obs.size())
+/* Scaled forward algorithm over dense parameters. alpha is a scratch buffer of 2*N doubles
+ * which is reused between calls. Returns the log-likelihood of obs, or -inf if it cannot be
+ * produced by this model. */
+double HiddenMarkovModel::forwardPass(const vector<int>& obs, HugePageVector<double>& alpha) const
+{
+	size_t N = _stateNames.size(), M = outputs().size();
+	if (obs.empty())
+		return 0;
+
+	alpha.resize(2*N);
+	double* cur = &alpha[0];
+	double* next = &alpha[N];
+	double logLikelihood = 0, scale = 0;
+
+	for (size_t i = 0; i < N; ++i)
 	{
-		map<string, vector<string> > newPath;
+		cur[i] = _pi[i] * _b[i*M + obs[0]];
+		scale += cur[i];
+	}
+
+	for (size_t t = 1; ; ++t)
+	{
+		if (scale == 0)
+			return -numeric_limits<double>::infinity();
+
+		logLikelihood += log(scale);
+		for (size_t i = 0; i < N; ++i)
+			cur[i] /= scale;
 
-		for (auto stt_i : _stateNames)
+		if (t == obs.size())
+			break;
+
+		/* Push the probability mass of each state along its outgoing transitions. */
+		fill(next, next + N, 0.0);
+		for (size_t i = 0; i < N; ++i)
+		{
+			const double* row = &_a[i*N];
+			for (size_t j = 0; j < N; ++j)
+				next[j] += cur[i] * row[j];
+		}
+
+		scale = 0;
+		for (size_t j = 0; j < N; ++j)
 		{
-			curMaxProb = 0;
+			next[j] *= _b[j*M + obs[t]];
+			scale += next[j];
+		}
+		swap(cur, next);
+	}
+
+	return logLikelihood;
+}
 
-			for (auto stt_j : _stateNames)
+/* Hands out the indices of a batch to workers in small chunks. */
+static const size_t CHUNK = 16;
+
+vector<double> HiddenMarkovModel::forward(const vector<vector<int> >& batch,
+										  const ExecutionPolicy& policy) const
+{
+	vector<double> ret(batch.size());
+	ProgressMeter meter(policy, batch.size());
+	atomic<size_t> next(0);
+
+	runWorkers(policy, [&](unsigned) {
+		const HiddenMarkovModel& hmm = _replicas.local(*this, policy.replicate);
+		HugePageVector<double> alpha;
+		CounterScope counters("forward");
+
+		for (size_t begin; (begin = next.fetch_add(CHUNK)) < batch.size(); )
+		{
+			for (size_t i = begin; i < min(begin + CHUNK, batch.size()); ++i)
 			{
-				double curr = V[t-1][stt_j] * transition(stt_j, stt_i) * emission(stt_i, obs[t]);
+				ret[i] = exp(hmm.forwardPass(batch[i], alpha));
+				meter.advance(1);
+			}
+		}
+	});
+
+	meter.finish();
+	return ret;
+}
+
+
+/* Log-space Viterbi recursion over dense parameters. delta and backptr are scratch buffers
+ * reused between calls; backptr is left holding the back pointers of every position. Returns
+ * the log probability of the best path and sets last to its final state, or returns -inf if
+ * no path can be built. */
+double HiddenMarkovModel::viterbiTrellis(const vector<int>& obs, HugePageVector<double>& delta,
+										 HugePageVector<int>& backptr, int& last) const
+{
+	size_t N = _stateNames.size(), M = outputs().size(), T = obs.size();
+	const double none = -numeric_limits<double>::infinity();
+
+	delta.resize(2*N);
+	backptr.resize(T*N);
+	double* cur = &delta[0];
+	double* next = &delta[N];
 
-				if (curr > curMaxProb)
+	for (size_t i = 0; i < N; ++i)
+		cur[i] = _logPi[i] + _logB[i*M + obs[0]];
+
+	for (size_t t = 1; t < T; ++t)
+	{
+		for (size_t j = 0; j < N; ++j)
+		{
+			/* Ties go to the lowest state ID. */
+			double best = none;
+			int from = 0;
+			for (size_t i = 0; i < N; ++i)
+			{
+				double cand = cur[i] + _logA[i*N + j];
+				if (cand > best)
 				{
-					curMaxProb = curr;
-					curMaxStt = stt_j;
+					best = cand;
+					from = i;
 				}
 			}
-			V[t][stt_i] = curMaxProb;
-
-			vector<string> tmp1 = path[curMaxStt];
-			vector<string> tmp2 = {stt_i};
-			tmp1.insert(tmp1.end(), tmp2.begin(), tmp2.end());
-			newPath[stt_i] = tmp1;
+			next[j] = best + _logB[j*M + obs[t]];
+			backptr[t*N + j] = from;
 		}
-		path = newPath; // don't need to remember the old paths
+		swap(cur, next);
+	}
 
-		++t;
+	double best = none;
+	last = 0;
+	for (size_t i = 0; i < N; ++i)
+	{
+		if (cur[i] > best)
+		{
+			best = cur[i];
+			last = i;
+		}
 	}
+	return best;
+}
 
-	curMaxProb = 0; // if only one element is observed, max is sought in the init values
 
-	int n = 0;
-	if (obs.size() != 1)
-		n = obs.size()-1;
+/* Log-space Viterbi over dense parameters. delta and backptr are scratch buffers reused
+ * between calls. Returns the log probability of the best path and its state IDs; the path is
+ * empty if no path can be built. */
+pair<double, vector<int> > HiddenMarkovModel::viterbiPass(const vector<int>& obs,
+														  HugePageVector<double>& delta,
+														  HugePageVector<int>& backptr) const
+{
+	size_t T = obs.size();
+	if (obs.empty())
+		return make_pair(0.0, vector<int>());
 
-	for (auto stt : _stateNames)
+	int last;
+	double best = viterbiTrellis(obs, delta, backptr, last);
+
+	/* Probability is zero; no such path can be built. */
+	if (best == -numeric_limits<double>::infinity())
+		return make_pair(best, vector<int>());
+
+	vector<int> path(T);
+	traceback(last, backptr, T, &path[0]);
+	return make_pair(best, path);
+}
+
+
+/* Follows the back pointers of a Viterbi trellis over T > 0 positions from state last at the
+ * end, writing the T states of the path to out. */
+void HiddenMarkovModel::traceback(int last, const HugePageVector<int>& backptr, size_t T,
+								  int32_t* out) const
+{
+	size_t N = _stateNames.size();
+	out[T-1] = last;
+	for (size_t t = T-1; t > 0; --t)
+		out[t-1] = backptr[t*N + out[t]];
+}
+
+
+/* Viterbi with a run-length traceback: walking the back pointers from the end, each position
+ * adds its emission and incoming transition to the score of the current run, and a run is
+ * closed when the state changes. Returns the log probability of the best path and its runs in
+ * order, or no runs if no path can be built. */
+pair<double, vector<Segment> > HiddenMarkovModel::segmentPass(const vector<int>& obs,
+															  HugePageVector<double>& delta,
+															  HugePageVector<int>& backptr) const
+{
+	size_t N = _stateNames.size(), M = outputs().size(), T = obs.size();
+	vector<Segment> segments;
+	if (obs.empty())
+		return make_pair(0.0, segments);
+
+	int state;
+	double best = viterbiTrellis(obs, delta, backptr, state);
+	if (best == -numeric_limits<double>::infinity())
+		return make_pair(best, segments);
+
+	Segment run;
+	run.state = state;
+	run.end = T;
+	run.score = 0;
+
+	for (size_t t = T-1; ; --t)
 	{
-		double curr = V[n][stt];
+		if (t == 0)
+		{
+			run.start = 0;
+			run.score += _logPi[state] + _logB[state*M + obs[0]];
+			segments.push_back(run);
+			break;
+		}
 
-		if (curr > curMaxProb)
+		int from = backptr[t*N + state];
+		run.score += _logA[from*N + state] + _logB[state*M + obs[t]];
+		if (from != state)
 		{
-			curMaxProb = curr;
-			curMaxStt = stt;
+			run.start = t;
+			segments.push_back(run);
+
+			run.state = from;
+			run.end = t;
+			run.score = 0;
 		}
+		state = from;
 	}
 
-	/* Probability is zero; no such path can be built. */
-	if (curMaxProb == 0)
-		path.clear();
+	reverse(segments.begin(), segments.end());
+	return make_pair(best, segments);
+}
+
+
+vector<pair<double, vector<int> > >
+HiddenMarkovModel::viterbi(const vector<vector<int> >& batch, const ExecutionPolicy& policy) const
+{
+	vector<pair<double, vector<int> > > ret(batch.size());
+	ProgressMeter meter(policy, batch.size());
+	atomic<size_t> next(0);
+
+	runWorkers(policy, [&](unsigned) {
+		const HiddenMarkovModel& hmm = _replicas.local(*this, policy.replicate);
+		HugePageVector<double> delta;
+		HugePageVector<int> backptr;
+		CounterScope counters("viterbi");
+
+		for (size_t begin; (begin = next.fetch_add(CHUNK)) < batch.size(); )
+		{
+			for (size_t i = begin; i < min(begin + CHUNK, batch.size()); ++i)
+			{
+				ret[i] = hmm.viterbiPass(batch[i], delta, backptr);
+				ret[i].first = exp(ret[i].first);
+				meter.advance(1);
+			}
+		}
+	});
 
-	return make_pair(curMaxProb, path[curMaxStt]);
+	meter.finish();
+	return ret;
 }
 
-vector<pair<double, vector<string> > > HiddenMarkovModel::viterbi(const string& filename)
+
+vector<pair<double, vector<Segment> > >
+HiddenMarkovModel::segments(const vector<vector<int> >& batch, const ExecutionPolicy& policy) const
 {
-	vector<vector<string> > observations = parseObsFile(filename);
-	if (observations.empty())
-		throw runtime_error("observation file is empty");
+	vector<pair<double, vector<Segment> > > ret(batch.size());
+	ProgressMeter meter(policy, batch.size());
+	atomic<size_t> next(0);
 
-	vector<pair<double, vector<string> > > ret;
+	runWorkers(policy, [&](unsigned) {
+		const HiddenMarkovModel& hmm = _replicas.local(*this, policy.replicate);
+		HugePageVector<double> delta;
+		HugePageVector<int> backptr;
+		CounterScope counters("segments");
 
-	/* Iterate through each sequence of observations. */
-	for (auto obs : observations)
-		ret.push_back(viterbiHelper(obs));
+		for (size_t begin; (begin = next.fetch_add(CHUNK)) < batch.size(); )
+		{
+			for (size_t i = begin; i < min(begin + CHUNK, batch.size()); ++i)
+			{
+				ret[i] = hmm.segmentPass(batch[i], delta, backptr);
+				meter.advance(1);
+			}
+		}
+	});
 
+	meter.finish();
 	return ret;
 }
 
 
-void HiddenMarkovModel::optimized(const string& obsFilename, const string& optFilename)
+void HiddenMarkovModel::score(const vector<vector<int> >& batch, ResultWriter& writer,
+							  const ExecutionPolicy& policy) const
 {
-	vector<vector<string> > observations = parseObsFile(obsFilename);
-	if (observations.empty())
-		throw runtime_error("observation file is empty");
+	size_t N = _stateNames.size();
+	bool paths = writer.columns() & ResultWriter::Paths;
+	bool posteriors = writer.columns() & ResultWriter::Posteriors;
+	if (writer.states() != N)
+		throw runtime_error("result file is laid out for a different number of states");
+
+	ProgressMeter meter(policy, batch.size());
+	atomic<size_t> next(0);
+
+	runWorkers(policy, [&](unsigned) {
+		const HiddenMarkovModel& hmm = _replicas.local(*this, policy.replicate);
+		HugePageVector<double> alpha, beta;
+		HugePageVector<int> backptr;
+		vector<double> scale;
+		CounterScope counters("results");
+
+		/* Results go straight into the sequence's slots of the mapped file, so neither the
+		 * posteriors nor the path are built anywhere else first. Unreachable sequences get
+		 * zero posteriors and -1 state IDs. */
+		for (size_t begin; (begin = next.fetch_add(CHUNK)) < batch.size(); )
+		{
+			for (size_t i = begin; i < min(begin + CHUNK, batch.size()); ++i)
+			{
+				const vector<int>& obs = batch[i];
+				size_t T = obs.size();
+				const double none = -numeric_limits<double>::infinity();
 
-	ofstream file(optFilename);
-	if (!file.is_open())
-		throw runtime_error("cannot create file: " + optFilename);
+				double logLikelihood = 0;
+				if (posteriors && T > 0)
+				{
+					double* gamma = writer.posterior(i);
+					logLikelihood = hmm.forwardBackward(obs, alpha, beta, scale);
+					if (logLikelihood == none)
+						fill(gamma, gamma + T*N, 0.0);
+					else
+						for (size_t k = 0; k < T*N; ++k)
+							gamma[k] = alpha[k] * beta[k];
+				}
+				else
+					logLikelihood = hmm.forwardPass(obs, alpha);
+				writer.logLikelihood(i) = logLikelihood;
 
-	int N = _stateNames.size(), M = _outputNames.size(), T = _numOfTimeSteps;
-	file << N << " " << M << " " << T << endl;
+				if (paths)
+				{
+					int32_t* path = writer.path(i);
+					int last = 0;
+					double best = (T > 0) ? hmm.viterbiTrellis(obs, beta, backptr, last) : 0;
+					writer.pathLogProbability(i) = best;
+
+					if (best == none)
+						fill(path, path + T, -1);
+					else if (T > 0)
+						hmm.traceback(last, backptr, T, path);
+				}
+				meter.advance(1);
+			}
+		}
+	});
 
-	/* Set with fixed floating point notation. */
-	//file.setf(ios_base::fixed, ios_base::floatfield);
+	meter.finish();
+}
 
-	/* Write state names. */
-	for (auto stt : _stateNames)
-		file << stt << " ";
-	file << endl;
 
-	/* Write observation symbols. */
-	for (auto out : _outputNames)
-		file << out << " ";
-	file << endl;
+BaumWelchStats::BaumWelchStats(size_t states, size_t outputs)
+	: transitions(states*states), emissions(states*outputs), initial(states),
+	  logLikelihood(0), sequences(0)
+{
+}
 
-	/* Write transition matrix. */
-	file << "a:" << endl;
-	for (auto rowStt : _stateNames)
-	{
-		for (auto colStt : _stateNames)
-			file << expectedTransition(observations[0], rowStt, colStt) << " ";
-		file << endl;
-	}
 
-	/* Write emission matrix. */
-	file << "b:" << endl;
-	for (auto stt : _stateNames)
+void BaumWelchStats::merge(const BaumWelchStats& other)
+{
+	for (size_t i = 0; i < transitions.size(); ++i)
+		transitions[i] += other.transitions[i];
+	for (size_t i = 0; i < emissions.size(); ++i)
+		emissions[i] += other.emissions[i];
+	for (size_t i = 0; i < initial.size(); ++i)
+		initial[i] += other.initial[i];
+
+	logLikelihood += other.logLikelihood;
+	sequences += other.sequences;
+}
+
+
+/* Advances the path entropy recursion of Hernando et al. (2005) by one step. H[j] is the
+ * entropy of the state paths that end in state j given the outputs so far; prev holds the
+ * normalized alphas of the previous step and pred[j] the sum over i of r = prev[i] * a[i][j],
+ * before emission. The predecessor weights are r / pred[j], so the new entropy of j is
+ * sum r (H[i] - log r) / pred[j] + log pred[j]. scratch holds 2*N doubles. */
+void HiddenMarkovModel::entropyStep(const double* prev, const double* pred, vector<double>& H,
+									vector<double>& scratch) const
+{
+	size_t N = _stateNames.size();
+	double* logPrev = &scratch[0];
+	double* nextH = &scratch[N];
+
+	for (size_t i = 0; i < N; ++i)
+		logPrev[i] = log(prev[i]);
+
+	fill(nextH, nextH + N, 0.0);
+	for (size_t i = 0; i < N; ++i)
 	{
-		for (auto out : _outputNames)
-			file << expectedEmission(observations[0], stt, out) << " ";
-		file << endl;
-	}
+		if (prev[i] == 0)
+			continue;
 
-	/* Write initial state matrix. */
-	file << "pi:" << endl;
-	for (auto stt : _stateNames)
-		file << expectedInitState(observations[0], stt) << " ";
-	file << endl;
+		for (size_t j = 0; j < N; ++j)
+		{
+			double r = prev[i] * _a[i*N + j];
+			if (r > 0)
+				nextH[j] += r * (H[i] - logPrev[i] - _logA[i*N + j]);
+		}
+	}
 
-	/* Unset all floating point notation flags. */
-	//file.unsetf(ios_base::floatfield);
+	for (size_t j = 0; j < N; ++j)
+		H[j] = (pred[j] > 0) ? nextH[j] / pred[j] + log(pred[j]) : 0.0;
 }
 
 
-double HiddenMarkovModel::xi(const vector<string>& obs, int t,
-							 const string& stt_i, const string& stt_j)
+/* Entropy of all state paths, from the entropies H of the paths ending in each state and the
+ * normalized alphas of the last step, which are the posterior of the final state. */
+static double pathEntropy(const double* last, const vector<double>& H)
 {
-	double sum1 = forwardHelper(obs, t, stt_i) * transition(stt_i, stt_j) *
-				 backwardHelper(obs, t+1, stt_j) * emission(stt_j, obs[t+1]);
+	double ret = 0;
+	for (size_t j = 0; j < H.size(); ++j)
+		if (last[j] > 0)
+			ret += last[j] * (H[j] - log(last[j]));
 
-	double sum2 = 0;
-	for (auto stt : _stateNames)
-		sum2 += forwardHelper(obs, t, stt) * backwardHelper(obs, t, stt);
-	return sum1 / sum2;
+	return ret;
 }
 
 
-double HiddenMarkovModel::gamma(const vector<string>& obs, int t, const string& curStt)
+/* Scaled backward pass matching the normalizers of a scaled forward pass, so that
+ * alpha[t*N + i] * beta[t*N + i] is the posterior of state i at t. */
+void HiddenMarkovModel::backwardPass(const vector<int>& obs, const vector<double>& scale,
+									 HugePageVector<double>& beta) const
 {
-	double sum = 0;
-	for (auto stt : _stateNames)
-		sum += xi(obs, t, curStt, stt);
-	return sum;
+	size_t N = _stateNames.size(), M = outputs().size(), T = obs.size();
+	beta.resize(T*N);
+
+	fill(&beta[(T-1)*N], &beta[(T-1)*N] + N, 1.0);
+	for (size_t t = T-1; t > 0; --t)
+	{
+		const double* next = &beta[t*N];
+		double* cur = &beta[(t-1)*N];
+
+		for (size_t i = 0; i < N; ++i)
+		{
+			double sum = 0;
+			for (size_t j = 0; j < N; ++j)
+				sum += _a[i*N + j] * _b[j*M + obs[t]] * next[j];
+			cur[i] = sum / scale[t];
+		}
+	}
 }
 
 
-double HiddenMarkovModel::expectedTransition(const vector<string>& obs,
-											 const string& stt_i, const string& stt_j)
+/* Scaled forward pass keeping the whole trellis. alpha receives T*N normalized variables and
+ * scale the per-step normalizers. If pathEntropy is given, the entropy of the posterior over
+ * state paths is carried along the recursion. Returns the log-likelihood, or -inf if the
+ * sequence cannot be produced. */
+double HiddenMarkovModel::forwardTrellis(const vector<int>& obs, HugePageVector<double>& alpha,
+										 vector<double>& scale, double* pathEntropy) const
 {
-	double sum1 = 0, sum2 = 0;
-	for (size_t t = 0; t < obs.size()-2; ++t)
+	size_t N = _stateNames.size(), M = outputs().size(), T = obs.size();
+	alpha.resize(T*N);
+	scale.resize(T);
+	double logLikelihood = 0;
+
+	vector<double> H, scratch;
+	if (pathEntropy)
+	{
+		H.assign(N, 0.0);
+		scratch.resize(2*N);
+	}
+
+	for (size_t t = 0; t < T; ++t)
 	{
-		sum1 += xi(obs, t, stt_i, stt_j);
-		sum2 += gamma(obs, t, stt_i);
+		double* cur = &alpha[t*N];
+
+		if (t == 0)
+		{
+			for (size_t i = 0; i < N; ++i)
+				cur[i] = _pi[i] * _b[i*M + obs[0]];
+		}
+		else
+		{
+			const double* prev = &alpha[(t-1)*N];
+			fill(cur, cur + N, 0.0);
+			for (size_t i = 0; i < N; ++i)
+				for (size_t j = 0; j < N; ++j)
+					cur[j] += prev[i] * _a[i*N + j];
+
+			if (pathEntropy)
+				entropyStep(prev, cur, H, scratch);
+
+			for (size_t j = 0; j < N; ++j)
+				cur[j] *= _b[j*M + obs[t]];
+		}
+
+		scale[t] = 0;
+		for (size_t i = 0; i < N; ++i)
+			scale[t] += cur[i];
+		if (scale[t] == 0)
+			return -numeric_limits<double>::infinity();
+
+		for (size_t i = 0; i < N; ++i)
+			cur[i] /= scale[t];
+		logLikelihood += log(scale[t]);
 	}
-	return (sum2 == 0.0) ? 0.0 : (sum1 / sum2);
+
+	if (pathEntropy)
+		*pathEntropy = ::pathEntropy(&alpha[(T-1)*N], H);
+
+	return logLikelihood;
 }
 
 
-double HiddenMarkovModel::expectedEmission(const vector<string>& obs, const string& curStt,
-										   const string& out)
+/* Scaled forward-backward pass, so that alpha[t*N + i] * beta[t*N + i] is the posterior of
+ * state i at t. Returns the log-likelihood, or -inf if the sequence cannot be produced. */
+double HiddenMarkovModel::forwardBackward(const vector<int>& obs, HugePageVector<double>& alpha,
+										  HugePageVector<double>& beta, vector<double>& scale,
+										  double* pathEntropy) const
 {
-	double sum1 = 0, sum2 = 0;
-	for (size_t t = 0; t < obs.size()-1; ++t)
-	{
-		if (obs[t] == out)
-			sum1 += gamma(obs, t, curStt);
+	double logLikelihood = forwardTrellis(obs, alpha, scale, pathEntropy);
+	if (logLikelihood != -numeric_limits<double>::infinity())
+		backwardPass(obs, scale, beta);
 
-		sum2 += gamma(obs, t, curStt);
+	return logLikelihood;
+}
+
+
+/* Decodes position t of a posterior decoding from its alphas and betas, renormalizing their
+ * products so that the betas may be scaled independently of the alphas. */
+void HiddenMarkovModel::decodePosition(const double* a, const double* b, size_t t,
+									   PosteriorDecoding& ret) const
+{
+	size_t N = _stateNames.size();
+	double norm = 0;
+	for (size_t i = 0; i < N; ++i)
+		norm += a[i] * b[i];
+	if (norm == 0)
+		return;
+
+	/* Ties go to the lowest state ID. */
+	double best = -1, entropy = 0;
+	for (size_t i = 0; i < N; ++i)
+	{
+		double gamma = a[i] * b[i] / norm;
+		if (gamma > best)
+		{
+			best = gamma;
+			ret.path[t] = i;
+		}
+		if (gamma > 0)
+			entropy -= gamma * log(gamma);
 	}
-	return (sum2 == 0.0) ? 0.0 : (sum1 / sum2);
+
+	ret.confidence[t] = best;
+	ret.entropy[t] = entropy;
 }
 
 
-double HiddenMarkovModel::expectedInitState(const vector<string>& obs, const string& curStt)
+void HiddenMarkovModel::decodePosterior(const HugePageVector<double>& alpha,
+										const HugePageVector<double>& beta, size_t T,
+										PosteriorDecoding& ret) const
 {
-	return gamma(obs, 0, curStt);
+	size_t N = _stateNames.size();
+	ret.path.resize(T);
+	ret.confidence.resize(T);
+	ret.entropy.resize(T);
+
+	for (size_t t = 0; t < T; ++t)
+		decodePosition(&alpha[t*N], &beta[t*N], t, ret);
+}
+
+
+PosteriorDecoding HiddenMarkovModel::posteriorPass(const vector<int>& obs,
+												   HugePageVector<double>& alpha,
+												   HugePageVector<double>& beta) const
+{
+	PosteriorDecoding ret;
+	if (obs.empty())
+		return ret;
+
+	vector<double> scale;
+	ret.logLikelihood = forwardBackward(obs, alpha, beta, scale, &ret.pathEntropy);
+	if (ret.logLikelihood == -numeric_limits<double>::infinity())
+	{
+		ret.pathEntropy = 0;
+		return ret;
+	}
+
+	decodePosterior(alpha, beta, obs.size(), ret);
+	return ret;
+}
+
+
+/* Posterior decoding with the forward and backward sweeps on two threads. The backward sweep
+ * normalizes by its own sums rather than the forward scales, so the sweeps are independent;
+ * decodePosition renormalizes each position instead. Both sweeps meet in the middle: once
+ * each has covered its first half, the forward sweep decodes the second half as it goes and
+ * the backward sweep the first half. */
+PosteriorDecoding HiddenMarkovModel::concurrentPosteriorPass(const vector<int>& obs,
+															 HugePageVector<double>& alpha,
+															 HugePageVector<double>& beta) const
+{
+	size_t N = _stateNames.size(), M = outputs().size(), T = obs.size(), mid = T / 2;
+	PosteriorDecoding ret;
+	ret.path.resize(T);
+	ret.confidence.resize(T);
+	ret.entropy.resize(T);
+
+	alpha.resize(T*N);
+	beta.resize(T*N);
+	promise<void> forwardHalf, backwardHalf;
+
+	/* A sweep that runs out of probability mass keeps going with zeros, so that it still
+	 * reaches the middle; the sequence is then reported as impossible. */
+	thread backward([&] {
+		/* Started from a worker that may be pinned, the sweep would otherwise share its CPU. */
+		unpinThread();
+		CounterScope counters("posterior-backward");
+
+		fill(&beta[(T-1)*N], &beta[(T-1)*N] + N, 1.0);
+		for (size_t t = T-1; ; --t)
+		{
+			if (t == mid)
+			{
+				backwardHalf.set_value();
+				forwardHalf.get_future().wait();
+			}
+			if (t < mid)
+				decodePosition(&alpha[t*N], &beta[t*N], t, ret);
+			if (t == 0)
+				break;
+
+			const double* next = &beta[t*N];
+			double* cur = &beta[(t-1)*N];
+			double sum = 0;
+			for (size_t i = 0; i < N; ++i)
+			{
+				cur[i] = 0;
+				for (size_t j = 0; j < N; ++j)
+					cur[i] += _a[i*N + j] * _b[j*M + obs[t]] * next[j];
+				sum += cur[i];
+			}
+			if (sum > 0)
+				for (size_t i = 0; i < N; ++i)
+					cur[i] /= sum;
+		}
+	});
+
+	vector<double> H(N, 0.0), scratch(2*N);
+	bool impossible = false;
+	for (size_t t = 0; t < T; ++t)
+	{
+		if (t == mid)
+		{
+			forwardHalf.set_value();
+			backwardHalf.get_future().wait();
+		}
+
+		double* cur = &alpha[t*N];
+		if (t == 0)
+		{
+			for (size_t i = 0; i < N; ++i)
+				cur[i] = _pi[i] * _b[i*M + obs[0]];
+		}
+		else
+		{
+			const double* prev = &alpha[(t-1)*N];
+			fill(cur, cur + N, 0.0);
+			for (size_t i = 0; i < N; ++i)
+				for (size_t j = 0; j < N; ++j)
+					cur[j] += prev[i] * _a[i*N + j];
+
+			entropyStep(prev, cur, H, scratch);
+			for (size_t j = 0; j < N; ++j)
+				cur[j] *= _b[j*M + obs[t]];
+		}
+
+		double scale = 0;
+		for (size_t i = 0; i < N; ++i)
+			scale += cur[i];
+		if (scale == 0)
+			impossible = true;
+		else
+		{
+			for (size_t i = 0; i < N; ++i)
+				cur[i] /= scale;
+			ret.logLikelihood += log(scale);
+		}
+
+		if (t >= mid)
+			decodePosition(cur, &beta[t*N], t, ret);
+	}
+	backward.join();
+
+	/* Report the sequence as the serial pass does. */
+	if (impossible)
+	{
+		ret.logLikelihood = -numeric_limits<double>::infinity();
+		ret.path.clear();
+		ret.confidence.clear();
+		ret.entropy.clear();
+		return ret;
+	}
+
+	ret.pathEntropy = pathEntropy(&alpha[(T-1)*N], H);
+	return ret;
+}
+
+
+/* Sequences with at least this many trellis steps (positions times transitions) are worth a
+ * second thread when it is free. */
+static const size_t CONCURRENT_SWEEP_WORK = 1 << 20;
+
+vector<PosteriorDecoding> HiddenMarkovModel::posterior(const vector<vector<int> >& batch,
+													   const ExecutionPolicy& policy) const
+{
+	vector<PosteriorDecoding> ret(batch.size());
+
+	/* Split long sequences over two threads when there are spare CPUs for the second one. */
+	bool split = policy.workers() >= 2*batch.size();
+	ProgressMeter meter(policy, batch.size());
+	atomic<size_t> next(0);
+
+	runWorkers(policy, [&](unsigned) {
+		const HiddenMarkovModel& hmm = _replicas.local(*this, policy.replicate);
+		HugePageVector<double> alpha, beta;
+		CounterScope counters("posterior");
+
+		for (size_t begin; (begin = next.fetch_add(CHUNK)) < batch.size(); )
+		{
+			for (size_t i = begin; i < min(begin + CHUNK, batch.size()); ++i)
+			{
+				size_t work = batch[i].size() * hmm.states().size() * hmm.states().size();
+				if (split && work >= CONCURRENT_SWEEP_WORK)
+					ret[i] = hmm.concurrentPosteriorPass(batch[i], alpha, beta);
+				else
+					ret[i] = hmm.posteriorPass(batch[i], alpha, beta);
+				meter.advance(1);
+			}
+		}
+	});
+
+	meter.finish();
+	return ret;
+}
+
+
+/* Returns the seed words for seed_seq of a list of 64-bit values. seed_seq keeps only the low
+ * 32 bits of each value it is given, so each value is split into its low and high halves. */
+static vector<uint32_t> seedWords(initializer_list<uint64_t> values)
+{
+	vector<uint32_t> ret;
+	for (auto value : values)
+	{
+		ret.push_back(static_cast<uint32_t>(value));
+		ret.push_back(static_cast<uint32_t>(value >> 32));
+	}
+	return ret;
+}
+
+
+/* Draws an index i < n with probability proportional to weights[i] * factors[i*stride] by
+ * scanning the cumulative sums; u is uniform in [0, 1). */
+static int drawIndex(const double* weights, const double* factors, size_t stride, size_t n,
+					 vector<double>& cdf, double u)
+{
+	double total = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		total += weights[i] * factors[i*stride];
+		cdf[i] = total;
+	}
+
+	/* Rounding may put the target at the very end; fall back to the last index with mass. */
+	size_t i = upper_bound(cdf.begin(), cdf.begin() + n, u * total) - cdf.begin();
+	if (i == n)
+		while (--i > 0 && cdf[i] == cdf[i-1])
+			;
+
+	return i;
+}
+
+
+/* Draws a state path backwards from a normalized forward trellis of path.size() positions. The
+ * last state follows the final filtered distribution; each earlier state is drawn from
+ * P(s_t = i | s_t+1 = j), which is proportional to alpha_t(i) a(i, j). */
+void HiddenMarkovModel::drawPath(const HugePageVector<double>& alpha, mt19937_64& rng,
+								 vector<double>& cdf, vector<int>& path) const
+{
+	size_t N = _stateNames.size(), T = path.size();
+	uniform_real_distribution<double> uniform;
+	const double one = 1.0;
+
+	path[T-1] = drawIndex(&alpha[(T-1)*N], &one, 0, N, cdf, uniform(rng));
+	for (size_t t = T-1; t > 0; --t)
+		path[t-1] = drawIndex(&alpha[(t-1)*N], &_a[path[t]], N, N, cdf, uniform(rng));
+}
+
+
+vector<vector<int> > HiddenMarkovModel::sample(const vector<int>& obs, size_t count,
+											   unsigned long seed,
+											   const ExecutionPolicy& policy) const
+{
+	size_t N = _stateNames.size(), T = obs.size();
+	vector<vector<int> > ret(count);
+	if (T == 0)
+		return ret;
+
+	HugePageVector<double> alpha;
+	vector<double> scale;
+	if (forwardTrellis(obs, alpha, scale) == -numeric_limits<double>::infinity())
+		return ret;
+
+	ProgressMeter meter(policy, count);
+	atomic<size_t> next(0);
+
+	runWorkers(policy, [&](unsigned) {
+		vector<double> cdf(N);
+		CounterScope counters("sample");
+
+		for (size_t begin; (begin = next.fetch_add(CHUNK)) < count; )
+		{
+			for (size_t k = begin; k < min(begin + CHUNK, count); ++k)
+			{
+				/* Each sample has its own generator, so samples do not depend on the number of
+				 * workers. */
+				vector<uint32_t> words = seedWords({seed, k});
+				seed_seq seq(words.begin(), words.end());
+				mt19937_64 rng(seq);
+
+				ret[k].resize(T);
+				drawPath(alpha, rng, cdf, ret[k]);
+
+				meter.advance(1);
+			}
+		}
+	});
+
+	meter.finish();
+	return ret;
+}
+
+
+/* Fused likelihood, Viterbi and optional posterior pass. The scaled forward and log-space
+ * max-product recursions share one loop over time and one gather of each emission column.
+ * alpha keeps the whole trellis only when posteriors are requested. */
+QueryResult HiddenMarkovModel::queryPass(const vector<int>& obs, bool posteriors,
+										 HugePageVector<double>& alpha,
+										 HugePageVector<double>& beta,
+										 HugePageVector<double>& delta,
+										 HugePageVector<int>& backptr) const
+{
+	size_t N = _stateNames.size(), M = outputs().size(), T = obs.size();
+	const double none = -numeric_limits<double>::infinity();
+	QueryResult ret;
+	if (T == 0)
+		return ret;
+
+	alpha.resize(posteriors ? T*N : 2*N);
+	delta.resize(2*N);
+	backptr.resize(T*N);
+	double* dcur = &delta[0];
+	double* dnext = &delta[N];
+
+	vector<double> scale(T), emit(N), logEmit(N), H, scratch;
+	if (posteriors)
+	{
+		H.assign(N, 0.0);
+		scratch.resize(2*N);
+	}
+
+	for (size_t t = 0; t < T; ++t)
+	{
+		for (size_t j = 0; j < N; ++j)
+		{
+			emit[j] = _b[j*M + obs[t]];
+			logEmit[j] = _logB[j*M + obs[t]];
+		}
+
+		double* cur = &alpha[(posteriors ? t : t % 2)*N];
+		if (t == 0)
+		{
+			for (size_t i = 0; i < N; ++i)
+			{
+				cur[i] = _pi[i] * emit[i];
+				dcur[i] = _logPi[i] + logEmit[i];
+			}
+		}
+		else
+		{
+			/* Both recursions walk the transition matrix row by row. Ties go to the lowest
+			 * state ID, as in the Viterbi pass. */
+			const double* prev = &alpha[(posteriors ? t-1 : (t-1) % 2)*N];
+			fill(cur, cur + N, 0.0);
+			fill(dnext, dnext + N, none);
+			fill(&backptr[t*N], &backptr[t*N] + N, 0);
+			for (size_t i = 0; i < N; ++i)
+			{
+				const double* row = &_a[i*N];
+				const double* logRow = &_logA[i*N];
+				for (size_t j = 0; j < N; ++j)
+				{
+					cur[j] += prev[i] * row[j];
+
+					double cand = dcur[i] + logRow[j];
+					if (cand > dnext[j])
+					{
+						dnext[j] = cand;
+						backptr[t*N + j] = i;
+					}
+				}
+			}
+
+			if (posteriors)
+				entropyStep(prev, cur, H, scratch);
+
+			for (size_t j = 0; j < N; ++j)
+			{
+				cur[j] *= emit[j];
+				dnext[j] += logEmit[j];
+			}
+			swap(dcur, dnext);
+		}
+
+		scale[t] = 0;
+		for (size_t i = 0; i < N; ++i)
+			scale[t] += cur[i];
+		if (scale[t] == 0)
+		{
+			ret.logLikelihood = ret.pathLogProbability = ret.posterior.logLikelihood = none;
+			return ret;
+		}
+
+		for (size_t i = 0; i < N; ++i)
+			cur[i] /= scale[t];
+		ret.logLikelihood += log(scale[t]);
+	}
+
+	int last = max_element(dcur, dcur + N) - dcur;
+	ret.pathLogProbability = dcur[last];
+	ret.path.resize(T);
+	ret.path[T-1] = last;
+	for (size_t t = T-1; t > 0; --t)
+		ret.path[t-1] = backptr[t*N + ret.path[t]];
+
+	if (posteriors)
+	{
+		ret.posterior.logLikelihood = ret.logLikelihood;
+		ret.posterior.pathEntropy = pathEntropy(&alpha[(T-1)*N], H);
+		backwardPass(obs, scale, beta);
+		decodePosterior(alpha, beta, T, ret.posterior);
+	}
+
+	return ret;
+}
+
+
+vector<QueryResult> HiddenMarkovModel::query(const vector<vector<int> >& batch, bool posteriors,
+											 const ExecutionPolicy& policy) const
+{
+	vector<QueryResult> ret(batch.size());
+	ProgressMeter meter(policy, batch.size());
+	atomic<size_t> next(0);
+
+	runWorkers(policy, [&](unsigned) {
+		const HiddenMarkovModel& hmm = _replicas.local(*this, policy.replicate);
+		HugePageVector<double> alpha, beta, delta;
+		HugePageVector<int> backptr;
+		CounterScope counters("query");
+
+		for (size_t begin; (begin = next.fetch_add(CHUNK)) < batch.size(); )
+		{
+			for (size_t i = begin; i < min(begin + CHUNK, batch.size()); ++i)
+			{
+				ret[i] = hmm.queryPass(batch[i], posteriors, alpha, beta, delta, backptr);
+				meter.advance(1);
+			}
+		}
+	});
+
+	meter.finish();
+	return ret;
+}
+
+
+/* X += L^T R for row-major rows x N matrices L and R. X is walked in tiles small enough to stay
+ * in cache while the rows stream past, and four rows are folded into each pass over a tile. */
+static void addProductTN(const double* L, const double* R, size_t rows, size_t N, double* X)
+{
+	static const size_t TILE = 64;
+
+	for (size_t i0 = 0; i0 < N; i0 += TILE)
+	{
+		for (size_t j0 = 0; j0 < N; j0 += TILE)
+		{
+			size_t i1 = min(i0 + TILE, N), j1 = min(j0 + TILE, N), r = 0;
+
+			for (; r + 4 <= rows; r += 4)
+			{
+				const double* l = &L[r*N];
+				const double* r0 = &R[r*N];
+				const double* r1 = r0 + N;
+				const double* r2 = r1 + N;
+				const double* r3 = r2 + N;
+
+				for (size_t i = i0; i < i1; ++i)
+				{
+					double w0 = l[i], w1 = l[N + i], w2 = l[2*N + i], w3 = l[3*N + i];
+					double* x = &X[i*N];
+					for (size_t j = j0; j < j1; ++j)
+						x[j] += w0 * r0[j] + w1 * r1[j] + w2 * r2[j] + w3 * r3[j];
+				}
+			}
+			for (; r < rows; ++r)
+			{
+				for (size_t i = i0; i < i1; ++i)
+				{
+					double w = L[r*N + i];
+					double* x = &X[i*N];
+					for (size_t j = j0; j < j1; ++j)
+						x[j] += w * R[r*N + j];
+				}
+			}
+		}
+	}
+}
+
+
+/* Adds the expected counts of one sequence, times weight, to stats. The expected transitions are
+ * xi_t(i, j) = alpha_t(i) a(i, j) b(j, o_t+1) beta_t+1(j) / scale_t+1; a(i, j) is the same for
+ * every t and every sequence, so stats.transitions only receives the sums over t of
+ * alpha_t(i) b(j, o_t+1) beta_t+1(j) / scale_t+1, and expectation() applies a(i, j) once at
+ * the end. alpha, beta, scale and weighted are scratch buffers reused between calls. */
+double HiddenMarkovModel::accumulate(const vector<int>& obs, BaumWelchStats& stats,
+									 HugePageVector<double>& alpha, HugePageVector<double>& beta,
+									 vector<double>& scale, vector<double>& weighted,
+									 double weight) const
+{
+	if (obs.empty())
+		return 0;
+
+	double logLikelihood = forwardBackward(obs, alpha, beta, scale);
+	if (logLikelihood == -numeric_limits<double>::infinity())
+		return logLikelihood;
+
+	addExpectedCounts(obs, alpha, beta, scale, weight, stats, weighted);
+	stats.logLikelihood += weight * logLikelihood;
+	++stats.sequences;
+	return logLikelihood;
+}
+
+
+/* Adds the expected emissions, initial states and transitions of a sequence, times weight, to
+ * stats from its scaled forward and backward trellises. The transition sums are the product
+ * of the alpha trellis, as a (T-1) x N matrix, with the matching matrix of scaled
+ * emission-weighted betas, which is added in chunks of time through the weighted scratch
+ * buffer. */
+void HiddenMarkovModel::addExpectedCounts(const vector<int>& obs,
+										  const HugePageVector<double>& alpha,
+										  const HugePageVector<double>& beta,
+										  const vector<double>& scale, double weight,
+										  BaumWelchStats& stats, vector<double>& weighted) const
+{
+	size_t N = _stateNames.size(), M = outputs().size(), T = obs.size();
+
+	for (size_t t = 0; t < T; ++t)
+	{
+		const double* a = &alpha[t*N];
+		const double* b = &beta[t*N];
+
+		for (size_t i = 0; i < N; ++i)
+		{
+			double gamma = weight * a[i] * b[i];
+			stats.emissions[i*M + obs[t]] += gamma;
+			if (t == 0)
+				stats.initial[i] += gamma;
+		}
+	}
+
+	static const size_t TIME_CHUNK = 64;
+	weighted.resize(min(T-1, TIME_CHUNK) * N);
+	for (size_t t0 = 0; t0 + 1 < T; t0 += TIME_CHUNK)
+	{
+		size_t rows = min(T-1 - t0, TIME_CHUNK);
+		for (size_t r = 0; r < rows; ++r)
+		{
+			size_t t = t0 + r + 1;
+			for (size_t j = 0; j < N; ++j)
+				weighted[r*N + j] = weight * _b[j*M + obs[t]] * beta[t*N + j] / scale[t];
+		}
+
+		addProductTN(&alpha[t0*N], &weighted[0], rows, N, &stats.transitions[0]);
+	}
+}
+
+
+/* Sum of log-likelihoods, for reduceItems. */
+struct LogLikelihoodSum
+{
+	LogLikelihoodSum() : logLikelihood(0) {}
+	void merge(const LogLikelihoodSum& other) { logLikelihood += other.logLikelihood; }
+
+	double logLikelihood;
+};
+
+double HiddenMarkovModel::logLikelihood(const vector<vector<int> >& corpus,
+										const ExecutionPolicy& policy) const
+{
+	return logLikelihood(corpus, NULL, policy);
+}
+
+
+double HiddenMarkovModel::logLikelihood(const vector<vector<int> >& corpus,
+										const vector<size_t>& items,
+										const ExecutionPolicy& policy) const
+{
+	return logLikelihood(corpus, &items, policy);
+}
+
+
+/* Sums over the sequences of corpus listed in items, or over all of them if items is NULL. */
+double HiddenMarkovModel::logLikelihood(const vector<vector<int> >& corpus,
+										const vector<size_t>* items,
+										const ExecutionPolicy& policy) const
+{
+	vector<HugePageVector<double> > alpha(policy.workers());
+
+	auto add = [&](unsigned worker, size_t i, LogLikelihoodSum& sum) {
+		sum.logLikelihood += forwardPass(corpus[items ? (*items)[i] : i], alpha[worker]);
+	};
+	return reduceItems<LogLikelihoodSum>(items ? items->size() : corpus.size(), policy, true, 64,
+		"loglik", [] { return LogLikelihoodSum(); }, add).logLikelihood;
+}
+
+
+BaumWelchStats HiddenMarkovModel::expectation(const vector<vector<int> >& corpus,
+											  const TrainingOptions& options) const
+{
+	return expectation(corpus, NULL, options);
+}
+
+
+/* Runs the E-step over the sequences of corpus listed in items, or over all of them if items
+ * is NULL. */
+BaumWelchStats HiddenMarkovModel::expectation(const vector<vector<int> >& corpus,
+											  const vector<size_t>* items,
+											  const TrainingOptions& options) const
+{
+	size_t N = _stateNames.size(), M = outputs().size();
+	vector<HugePageVector<double> > alpha(options.execution.workers());
+	vector<HugePageVector<double> > beta(options.execution.workers());
+	vector<vector<double> > scale(options.execution.workers());
+	vector<vector<double> > weighted(options.execution.workers());
+
+	auto add = [&](unsigned worker, size_t i, BaumWelchStats& stats) {
+		accumulate(corpus[items ? (*items)[i] : i], stats, alpha[worker], beta[worker],
+				   scale[worker], weighted[worker]);
+	};
+	BaumWelchStats stats = reduceItems<BaumWelchStats>(items ? items->size() : corpus.size(),
+		options.execution, options.deterministic, options.shardSize, "estep",
+		[&] { return BaumWelchStats(N, M); }, add);
+
+	/* accumulate() leaves the transition probabilities out of the expected transitions. */
+	for (size_t k = 0; k < N*N; ++k)
+		stats.transitions[k] *= _a[k];
+
+	return stats;
+}
+
+
+void HiddenMarkovModel::maximize(const BaumWelchStats& stats)
+{
+	size_t N = _stateNames.size(), M = outputs().size();
+	double initial = 0;
+	for (size_t i = 0; i < N; ++i)
+		initial += stats.initial[i];
+
+	for (size_t i = 0; i < N; ++i)
+	{
+		double transitions = 0, emissions = 0;
+		for (size_t j = 0; j < N; ++j)
+			transitions += stats.transitions[i*N + j];
+		for (size_t k = 0; k < M; ++k)
+			emissions += stats.emissions[i*M + k];
+
+		for (size_t j = 0; j < N; ++j)
+			_a[i*N + j] = (transitions == 0.0) ? 0.0 : stats.transitions[i*N + j] / transitions;
+		for (size_t k = 0; k < M; ++k)
+			_b[i*M + k] = (emissions == 0.0) ? 0.0 : stats.emissions[i*M + k] / emissions;
+		_pi[i] = (initial == 0.0) ? 0.0 : stats.initial[i] / initial;
+	}
+
+	/* Keep the string keyed parameters in step with the dense ones. */
+	for (size_t i = 0; i < N; ++i)
+	{
+		for (size_t j = 0; j < N; ++j)
+			_transitions[_stateNames[i]][_stateNames[j]] = _a[i*N + j];
+		for (size_t k = 0; k < M; ++k)
+			_emissions[_stateNames[i]][outputs()[k]] = _b[i*M + k];
+		_initStates[_stateNames[i]] = _pi[i];
+	}
+	updateLogTables();
+}
+
+
+void HiddenMarkovModel::save(const string& filename) const
+{
+	ofstream file(filename);
+	if (!file.is_open())
+		throw runtime_error("cannot create file: " + filename);
+
+	size_t N = _stateNames.size(), M = outputs().size();
+	file << N << " " << M << " " << _numOfTimeSteps << endl;
+
+	/* Write state names. */
+	for (auto stt : _stateNames)
+		file << stt << " ";
+	file << endl;
+
+	/* Write observation symbols. */
+	for (auto out : outputs())
+		file << out << " ";
+	file << endl;
+
+	/* Write transition matrix. */
+	file << "a:" << endl;
+	for (size_t i = 0; i < N; ++i)
+	{
+		for (size_t j = 0; j < N; ++j)
+			file << _a[i*N + j] << " ";
+		file << endl;
+	}
+
+	/* Write emission matrix. */
+	file << "b:" << endl;
+	for (size_t i = 0; i < N; ++i)
+	{
+		for (size_t k = 0; k < M; ++k)
+			file << _b[i*M + k] << " ";
+		file << endl;
+	}
+
+	/* Write initial state matrix. */
+	file << "pi:" << endl;
+	for (size_t i = 0; i < N; ++i)
+		file << _pi[i] << " ";
+	file << endl;
+}
+
+
+/* Tells whether the held-out log-likelihoods of score beat those of best. Sequences that
+ * either cannot produce are skipped, so that one unproducible sequence neither freezes
+ * training nor hides progress on the others. */
+static bool improves(const vector<double>& score, const vector<double>& best)
+{
+	const double none = -numeric_limits<double>::infinity();
+	double gain = 0;
+	for (size_t i = 0; i < score.size(); ++i)
+		if (score[i] != none && best[i] != none)
+			gain += score[i] - best[i];
+	return gain > 0;
+}
+
+
+double HiddenMarkovModel::train(const vector<vector<int> >& corpus, const TrainingOptions& options)
+{
+	return train(corpus, NULL, options);
+}
+
+
+double HiddenMarkovModel::train(const vector<vector<int> >& corpus, const vector<size_t>& items,
+								const TrainingOptions& options)
+{
+	return train(corpus, &items, options);
+}
+
+
+/* Trains on the sequences of corpus listed in items, or on all of them if items is NULL. */
+double HiddenMarkovModel::train(const vector<vector<int> >& corpus, const vector<size_t>* items,
+								const TrainingOptions& options)
+{
+	double logLikelihood = -numeric_limits<double>::infinity();
+	size_t iteration = 0;
+
+	/* Tag the E-step's progress reports with the iteration and the last likelihood. */
+	TrainingOptions pass = options;
+	if (options.execution.progress)
+	{
+		pass.execution.progress = [&](const Progress& progress) {
+			Progress tagged = progress;
+			tagged.iteration = iteration;
+			tagged.logLikelihood = logLikelihood;
+			options.execution.progress(tagged);
+		};
+	}
+
+	/* The held-out sequences are scored by one extra thread while the E-step, which reads the
+	 * same parameters, runs on the remaining workers. */
+	vector<vector<int> > validation;
+	ExecutionPolicy scoring;
+	if (options.validation)
+	{
+		validation = intern(*options.validation);
+		scoring.cancellation = options.execution.cancellation;
+		if (pass.execution.workers() > 1)
+			pass.execution.threads = pass.execution.workers() - 1;
+	}
+
+	HugePageVector<double> heldOutAlpha;
+	auto scoreHeldOut = [&] {
+		vector<double> score(validation.size());
+		for (size_t i = 0; i < validation.size(); ++i)
+		{
+			if (scoring.cancelled())
+				throw Cancelled();
+			score[i] = forwardPass(validation[i], heldOutAlpha);
+		}
+		return score;
+	};
+
+	/* The first scored iteration is the best so far, whatever its score. */
+	HiddenMarkovModel best(*this);
+	vector<double> bestValidation;
+	double bestLogLikelihood = logLikelihood;
+	size_t sinceBest = 0;
+	bool scored = false;
+
+	for (iteration = 1; iteration <= options.iterations; ++iteration)
+	{
+		if (options.execution.cancelled())
+			throw Cancelled();
+
+		future<vector<double> > heldOut;
+		if (options.validation)
+			heldOut = async(launch::async, scoreHeldOut);
+
+		/* The E-step runs against the current parameters, so a cancelled iteration leaves the
+		 * model as the previous one left it. */
+		BaumWelchStats stats = expectation(corpus, items, pass);
+
+		if (options.validation)
+		{
+			vector<double> score = heldOut.get();
+			if (!scored || improves(score, bestValidation))
+			{
+				scored = true;
+				best = *this;
+				bestValidation = score;
+				bestLogLikelihood = stats.logLikelihood;
+				sinceBest = 0;
+			}
+			else if (++sinceBest >= options.patience)
+			{
+				*this = best;
+				return bestLogLikelihood;
+			}
+		}
+
+		maximize(stats);
+		logLikelihood = stats.logLikelihood;
+	}
+
+	/* The parameters of the last re-estimation have not been scored yet. */
+	if (options.validation && scored && !improves(scoreHeldOut(), bestValidation))
+	{
+		*this = best;
+		return bestLogLikelihood;
+	}
+
+	return logLikelihood;
+}
+
+
+/* Replaces each row of counts, cols wide, with a draw from the Dirichlet distribution whose
+ * parameters are prior plus the row's counts. Rows without any mass become zero. */
+static void drawDirichletRows(vector<double>& counts, size_t cols, double prior, mt19937_64& rng)
+{
+	for (size_t r = 0; r < counts.size() / cols; ++r)
+	{
+		double* row = &counts[r*cols];
+		double sum = 0;
+		for (size_t c = 0; c < cols; ++c)
+		{
+			double shape = prior + row[c];
+			row[c] = (shape > 0) ? gamma_distribution<double>(shape, 1.0)(rng) : 0.0;
+			sum += row[c];
+		}
+		for (size_t c = 0; c < cols; ++c)
+			row[c] = (sum > 0) ? row[c] / sum : 0.0;
+	}
+}
+
+
+double HiddenMarkovModel::gibbs(const vector<vector<int> >& corpus, const GibbsOptions& options)
+{
+	size_t N = _stateNames.size(), M = outputs().size();
+	size_t sweep = 0, kept = 0;
+	double logLikelihood = -numeric_limits<double>::infinity(), keptLogLikelihood = 0;
+
+	/* current holds the parameter sample the paths are drawn from. The kept samples are summed
+	 * as counts, so that maximize() turns their sum into the posterior mean. */
+	HiddenMarkovModel current(*this);
+	BaumWelchStats keptSum(N, M);
+
+	ExecutionPolicy pass = options.execution;
+	if (options.execution.progress)
+	{
+		pass.progress = [&](const Progress& progress) {
+			Progress tagged = progress;
+			tagged.iteration = sweep;
+			tagged.logLikelihood = logLikelihood;
+			options.execution.progress(tagged);
+		};
+	}
+
+	vector<HugePageVector<double> > alpha(options.execution.workers());
+	vector<vector<double> > scale(options.execution.workers());
+	vector<vector<double> > cdf(options.execution.workers(), vector<double>(N));
+	vector<vector<int> > path(options.execution.workers());
+
+	/* Draws the path of sequence i under the current sample and adds its counts. */
+	auto draw = [&](unsigned worker, size_t i, BaumWelchStats& counts) {
+		const vector<int>& obs = corpus[i];
+		if (obs.empty())
+			return;
+
+		double ll = current.forwardTrellis(obs, alpha[worker], scale[worker]);
+		if (ll == -numeric_limits<double>::infinity())
+			return;
+
+		vector<uint32_t> words = seedWords({options.seed, sweep, i});
+		seed_seq seq(words.begin(), words.end());
+		mt19937_64 rng(seq);
+		vector<int>& p = path[worker];
+		p.resize(obs.size());
+		current.drawPath(alpha[worker], rng, cdf[worker], p);
+
+		counts.initial[p[0]] += 1;
+		for (size_t t = 0; t < obs.size(); ++t)
+		{
+			counts.emissions[p[t]*M + obs[t]] += 1;
+			if (t > 0)
+				counts.transitions[p[t-1]*N + p[t]] += 1;
+		}
+		counts.logLikelihood += ll;
+		++counts.sequences;
+	};
+
+	try
+	{
+		for (sweep = 1; sweep <= options.sweeps; ++sweep)
+		{
+			if (options.execution.cancelled())
+				throw Cancelled();
+
+			/* Path counts are integers, so their sum does not depend on the reduction order;
+			 * the likelihood is combined over fixed shards to keep runs reproducible. */
+			BaumWelchStats counts = reduceItems<BaumWelchStats>(corpus.size(), pass, true, 64,
+				"gibbs", [&] { return BaumWelchStats(N, M); }, draw);
+			logLikelihood = counts.logLikelihood;
+
+			/* Redraw the parameters from their posteriors given the paths. */
+			vector<uint32_t> words = seedWords({options.seed, sweep});
+			seed_seq seq(words.begin(), words.end());
+			mt19937_64 rng(seq);
+			drawDirichletRows(counts.transitions, N, options.transitionPrior, rng);
+			drawDirichletRows(counts.emissions, M, options.emissionPrior, rng);
+			drawDirichletRows(counts.initial, N, options.initialPrior, rng);
+			counts.sequences = 1;
+			current.maximize(counts);
+
+			if (sweep <= options.burnIn || (sweep - options.burnIn) % max<size_t>(options.thin, 1))
+				continue;
+
+			keptSum.merge(counts);
+			keptLogLikelihood += logLikelihood;
+			++kept;
+			if (!options.checkpointPrefix.empty())
+				current.save(options.checkpointPrefix + to_string(kept) + ".hmm");
+		}
+	}
+	catch (const Cancelled&)
+	{
+		if (kept)
+			maximize(keptSum);
+		throw;
+	}
+
+	if (kept == 0)
+		throw runtime_error("no Gibbs samples kept; check the sweeps, burn-in and thinning");
+
+	maximize(keptSum);
+	return keptLogLikelihood / kept;
+}
+
+
+void HiddenMarkovModel::optimized(const string& obsFilename, const string& optFilename,
+								  const GibbsOptions& options)
+{
+	vector<vector<string> > observations = parseObsFile(obsFilename);
+	if (observations.empty())
+		throw runtime_error("observation file is empty");
+
+	/* When the job is cancelled, the mean of the samples kept so far is written. */
+	HiddenMarkovModel optimized(*this);
+	try
+	{
+		optimized.gibbs(intern(observations), options);
+	}
+	catch (const Cancelled&)
+	{
+		optimized.save(optFilename);
+		throw;
+	}
+	optimized.save(optFilename);
+}
+
+
+void HiddenMarkovModel::optimized(const string& obsFilename, const string& optFilename,
+								  const TrainingOptions& options)
+{
+	vector<vector<string> > observations = parseObsFile(obsFilename);
+	if (observations.empty())
+		throw runtime_error("observation file is empty");
+
+	/* Baum-Welch re-estimation over all sequences; this model is left as it is. When the job
+	 * is cancelled, the last completed iteration is written before giving up. */
+	HiddenMarkovModel optimized(*this);
+	try
+	{
+		optimized.train(intern(observations), options);
+	}
+	catch (const Cancelled&)
+	{
+		optimized.save(optFilename);
+		throw;
+	}
+	optimized.save(optFilename);
 }
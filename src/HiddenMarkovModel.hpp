@@ -1,9 +1,150 @@
 #ifndef GUARD_HMM_HPP
 #define GUARD_HMM_HPP
 
+#include <cstdint>
 #include <map>
+#include <memory>
+#include <random>
 #include <string>
 #include <vector>
+#include "HugePages.hpp"
+#include "Parallel.hpp"
+
+
+class ResultWriter;
+
+
+/*
+ * Output symbols of a model and their interned IDs. Models with identical symbol lists can
+ * share one instance.
+ */
+struct Vocabulary
+{
+	Vocabulary(const std::vector<std::string>& names);
+
+	std::vector<std::string> names;
+	std::map<std::string, int> ids;
+};
+
+/*
+ * Expected counts gathered by the Baum-Welch E-step over a corpus. Sequences the model cannot
+ * produce contribute nothing.
+ */
+struct BaumWelchStats
+{
+	BaumWelchStats(size_t states = 0, size_t outputs = 0);
+
+	/** Adds other's counts to these. */
+	void merge(const BaumWelchStats& other);
+
+	std::vector<double> transitions;	// N*N expected transitions
+	std::vector<double> emissions;		// N*M expected emissions
+	std::vector<double> initial;		// N expected initial states
+	double logLikelihood;
+	size_t sequences;
+};
+
+
+/*
+ * Posterior decoding of one observation sequence: the most probable state at each position,
+ * its posterior probability, the entropy of the state marginal at each position and the
+ * entropy of the posterior distribution over whole state paths. Entropies are in nats. The
+ * path is empty and the log-likelihood -inf if the model cannot produce the sequence.
+ */
+struct PosteriorDecoding
+{
+	PosteriorDecoding() : logLikelihood(0), pathEntropy(0) {}
+
+	double logLikelihood;
+	std::vector<int> path;
+	std::vector<double> confidence;
+	std::vector<double> entropy;
+	double pathEntropy;
+};
+
+
+/*
+ * Results of a fused query over one observation sequence: its log-likelihood, the log
+ * probability and state IDs of its most likely path, and, if requested, its posterior
+ * decoding.
+ */
+struct QueryResult
+{
+	QueryResult() : logLikelihood(0), pathLogProbability(0) {}
+
+	double logLikelihood;
+	double pathLogProbability;
+	std::vector<int> path;
+	PosteriorDecoding posterior;
+};
+
+
+/*
+ * A run of one state over positions [start, end) of a Viterbi path. score is the log
+ * probability the path accrues over the run: entering the state, by the initial distribution
+ * or a transition, and every emission and self-transition in it. The scores of the segments
+ * of a path add up to its log probability.
+ */
+struct Segment
+{
+	int state;
+	size_t start, end;
+	double score;
+};
+
+
+/*
+ * How Baum-Welch statistics are gathered. By default each worker merges its statistics into
+ * the total as it finishes, so the summation order, and thus the last bits of the result,
+ * depend on timing and the number of workers. In deterministic mode the corpus is cut into
+ * fixed shards of shardSize sequences and the shard statistics are combined by a fixed-shape
+ * pairwise tree, which gives bit-identical models for any number of workers.
+ *
+ * If validation is set, every iteration also scores those held-out sequences under the
+ * parameters its E-step runs against, on a thread of its own next to the E-step workers.
+ * Training stops early once their log-likelihood has not improved for patience iterations,
+ * and keeps the parameters that scored best. Held-out sequences that one of the compared
+ * parameter sets cannot produce are left out of the comparison.
+ * Only first-order models support validation, and only with Baum-Welch training.
+ */
+struct TrainingOptions
+{
+	TrainingOptions()
+		: iterations(1), deterministic(false), shardSize(64), validation(NULL), patience(3) {}
+
+	ExecutionPolicy execution;
+	size_t iterations;
+	bool deterministic;
+	size_t shardSize;
+	const std::vector<std::vector<std::string> >* validation;
+	size_t patience;
+};
+
+
+/*
+ * Options of the Gibbs trainer. Each row of the transition and emission matrices and the
+ * initial distribution has a symmetric Dirichlet prior with the given concentration. Of the
+ * sweeps, the first burnIn are discarded and after that every thin-th is kept; the trained
+ * model is the mean of the kept parameter samples. If checkpointPrefix is set, kept sample n
+ * is also written to <checkpointPrefix><n>.hmm. Sweep s draws the path of sequence i from a
+ * generator seeded with (seed, s, i), so runs do not depend on the number of workers.
+ */
+struct GibbsOptions
+{
+	GibbsOptions()
+		: sweeps(1000), burnIn(100), thin(10), transitionPrior(1), emissionPrior(1),
+		  initialPrior(1), seed(0) {}
+
+	ExecutionPolicy execution;
+	size_t sweeps;
+	size_t burnIn;
+	size_t thin;
+	double transitionPrior;
+	double emissionPrior;
+	double initialPrior;
+	unsigned long seed;
+	std::string checkpointPrefix;
+};
 
 
 /*
@@ -16,11 +157,28 @@
  */
 class HiddenMarkovModel
 {
+	friend class HiddenMarkovMixture;
+	friend class StateEditor;
+
 public:
 	HiddenMarkovModel(const std::string& filename);
 
+	/**
+	 * Returns a model with states S0, S1, ... whose parameter rows are drawn at random from a
+	 * generator seeded with seed, as a starting point for training.
+	 */
+	static HiddenMarkovModel random(size_t states, const std::shared_ptr<const Vocabulary>& vocabulary,
+									size_t timeSteps, unsigned long seed);
+
 	const std::vector<std::string>& states() const { return _stateNames; }
-	const std::vector<std::string>& outputs() const { return _outputNames; }
+	const std::vector<std::string>& outputs() const { return _vocabulary->names; }
+	const std::shared_ptr<const Vocabulary>& vocabulary() const { return _vocabulary; }
+
+	/**
+	 * Replaces this model's output vocabulary with an identical shared instance.
+	 * Throws if the vocabularies differ.
+	 */
+	void shareVocabulary(const std::shared_ptr<const Vocabulary>& vocabulary);
 	const int timeSteps() const { return _numOfTimeSteps; }
 
 	/**
@@ -53,11 +211,19 @@ public:
 	 * Returns probability of an output sequence based on a given state sequence.
 	 */
 	double eval(const std::vector<std::string>& out, const std::vector<std::string>& stt);
+	/**
+	 * Returns the log probability of an interned output sequence along each of many candidate
+	 * state ID paths, or -inf for paths of the wrong length. Candidates are inserted into one
+	 * trie, so a prefix shared by several paths is only scored once.
+	 */
+	std::vector<double> scorePaths(const std::vector<int>& obs,
+								   const std::vector<std::vector<int> >& paths) const;
 
 	/**
 	 * Returns the forward variables for each observation sequence in a given .obs file.
 	 */
-	std::vector<double> forward(const std::string& filename);
+	std::vector<double> forward(const std::string& filename,
+								const ExecutionPolicy& policy = ExecutionPolicy());
 	/**
 	 * Returns the backward variables for each observation sequence in a given .obs file.
 	 */
@@ -66,33 +232,206 @@ public:
 	 * Returns the pair of the most likely state sequence probability and its actual state path
 	 * for each observation sequence in a given .obs file.
 	 */
-	std::vector<std::pair<double, std::vector<std::string> > > viterbi(const std::string& filename);
+	std::vector<std::pair<double, std::vector<std::string> > >
+		viterbi(const std::string& filename, const ExecutionPolicy& policy = ExecutionPolicy());
+
+	/**
+	 * Returns the observation sequence as interned output symbol IDs, which is what the dense
+	 * engines below operate on. Throws if a symbol is not an output of this model.
+	 */
+	std::vector<int> intern(const std::vector<std::string>& obs) const;
+	std::vector<std::vector<int> > intern(const std::vector<std::vector<std::string> >& obs) const;
 	/**
-	 * Writes an optimized HMM with respect to a given observation sequence in an .obs file.
+	 * Maps state names to the state IDs used by the interned engines.
 	 */
-	void optimized(const std::string& obsFilename, const std::string& optFilename);
+	std::vector<int> internStates(const std::vector<std::string>& stt) const;
+	/**
+	 * Returns the probability of each interned observation sequence in a batch. Each worker runs
+	 * its share of the batch through the dense forward engine with one scratch trellis.
+	 */
+	std::vector<double> forward(const std::vector<std::vector<int> >& batch,
+								const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Returns the most likely state sequence probability and its state IDs for each interned
+	 * observation sequence in a batch. The path is empty when no path can be built.
+	 */
+	std::vector<std::pair<double, std::vector<int> > >
+		viterbi(const std::vector<std::vector<int> >& batch,
+				const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Returns the most likely state sequence log probability and its runs of equal states for
+	 * each interned observation sequence in a batch. The runs are built during the traceback,
+	 * so the per-position path is never stored. They are empty when no path can be built.
+	 */
+	std::vector<std::pair<double, std::vector<Segment> > >
+		segments(const std::vector<std::vector<int> >& batch,
+				 const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Scores each interned observation sequence in a batch and stores its log-likelihood and,
+	 * if the writer has the columns for them, its Viterbi path and state posteriors straight
+	 * into the sequence's slots of the writer's mapped file. Workers fill their sequences as
+	 * they finish them, in no particular order.
+	 */
+	void score(const std::vector<std::vector<int> >& batch, ResultWriter& writer,
+			   const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Runs posterior decoding over each interned observation sequence in a batch. Confidences
+	 * and entropies come out of the same scaled forward-backward sweep; the path entropy is
+	 * carried along the forward recursion, so no pass enumerates paths. When the batch leaves
+	 * CPUs idle, the forward and backward sweeps of long sequences run on two threads.
+	 */
+	std::vector<PosteriorDecoding> posterior(const std::vector<std::vector<int> >& batch,
+											 const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Answers the likelihood, Viterbi and optionally posterior queries for each interned
+	 * observation sequence in a batch at once. The sum and max-product recursions run in the
+	 * same loop over time and share each emission gather; posteriors add one backward pass.
+	 */
+	std::vector<QueryResult> query(const std::vector<std::vector<int> >& batch, bool posteriors,
+								   const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Draws count state ID paths from the posterior over paths of an interned observation
+	 * sequence by forward-filtering backward-sampling. The forward trellis is computed once
+	 * and the samples are drawn in parallel; sample k only depends on seed and k. The paths
+	 * are empty if the model cannot produce the sequence.
+	 */
+	std::vector<std::vector<int> > sample(const std::vector<int>& obs, size_t count,
+										  unsigned long seed = 0,
+										  const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Returns the total log-likelihood of a corpus of interned observation sequences, or -inf
+	 * if the model cannot produce one of them. Sums are combined over fixed shards, so the
+	 * result does not depend on the number of workers.
+	 */
+	double logLikelihood(const std::vector<std::vector<int> >& corpus,
+						 const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Returns the total log-likelihood of the sequences of corpus listed in items.
+	 */
+	double logLikelihood(const std::vector<std::vector<int> >& corpus,
+						 const std::vector<size_t>& items,
+						 const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Runs the Baum-Welch E-step over a corpus of interned observation sequences.
+	 */
+	BaumWelchStats expectation(const std::vector<std::vector<int> >& corpus,
+							   const TrainingOptions& options = TrainingOptions()) const;
+	/**
+	 * Re-estimates the model parameters from E-step statistics. Rows of states that were never
+	 * visited become zero. The initial distribution is the normalized initial counts, so
+	 * sequences may carry weights.
+	 */
+	void maximize(const BaumWelchStats& stats);
+	/**
+	 * Runs Baum-Welch iterations over a corpus in place and returns the log-likelihood of the
+	 * corpus before the last re-estimation. With validation, the model ends up with the
+	 * parameters that scored best on it; if those are not the last ones, the corpus
+	 * log-likelihood under them is returned.
+	 * Throws Cancelled if the job is cancelled; the model then holds the parameters of the last
+	 * completed iteration.
+	 */
+	double train(const std::vector<std::vector<int> >& corpus,
+				 const TrainingOptions& options = TrainingOptions());
+	/**
+	 * Runs Baum-Welch iterations over the sequences of corpus listed in items, so that a
+	 * corpus can be split without copying it.
+	 */
+	double train(const std::vector<std::vector<int> >& corpus, const std::vector<size_t>& items,
+				 const TrainingOptions& options = TrainingOptions());
+	/**
+	 * Trains the model in place by blocked Gibbs sampling: each sweep draws a state path for
+	 * every sequence by forward-filtering backward-sampling, in parallel, and then redraws the
+	 * parameters from their Dirichlet posteriors given the path counts. Returns the mean corpus
+	 * log-likelihood of the kept sweeps. Throws Cancelled if the job is cancelled; the model
+	 * then holds the mean of the samples kept so far, or is left as it was if there are none.
+	 */
+	double gibbs(const std::vector<std::vector<int> >& corpus,
+				 const GibbsOptions& options = GibbsOptions());
+	/**
+	 * Writes the model to an .hmm file.
+	 */
+	void save(const std::string& filename) const;
+	/**
+	 * Writes an optimized HMM with respect to the observation sequences in an .obs file. If
+	 * training is cancelled, the last completed iteration is written and Cancelled rethrown.
+	 */
+	void optimized(const std::string& obsFilename, const std::string& optFilename,
+				   const TrainingOptions& options = TrainingOptions());
+	/**
+	 * Writes the posterior mean model of Gibbs training on the sequences in an .obs file. If
+	 * training is cancelled, the mean of the samples kept so far is written.
+	 */
+	void optimized(const std::string& obsFilename, const std::string& optFilename,
+				   const GibbsOptions& options);
 
 private:
+	HiddenMarkovModel() {}
+
 	double forwardHelper(const std::vector<std::string>&, int, const std::string&);
 	double backwardHelper(const std::vector<std::string>&, int, const std::string&);
-	std::pair<double, std::vector<std::string> > viterbiHelper(const std::vector<std::string>&);
 
-	double xi(const std::vector<std::string>&, int, const std::string&, const std::string&);
-	double gamma(const std::vector<std::string>&, int, const std::string&);
+	double logLikelihood(const std::vector<std::vector<int> >&, const std::vector<size_t>*,
+						 const ExecutionPolicy&) const;
+	BaumWelchStats expectation(const std::vector<std::vector<int> >&, const std::vector<size_t>*,
+							   const TrainingOptions&) const;
+	double train(const std::vector<std::vector<int> >&, const std::vector<size_t>*,
+				 const TrainingOptions&);
+
+	double forwardPass(const std::vector<int>&, HugePageVector<double>&) const;
+	double viterbiTrellis(const std::vector<int>&, HugePageVector<double>&, HugePageVector<int>&,
+						  int&) const;
+	void traceback(int, const HugePageVector<int>&, size_t, int32_t*) const;
+	std::pair<double, std::vector<int> > viterbiPass(const std::vector<int>&,
+													 HugePageVector<double>&, HugePageVector<int>&) const;
+	std::pair<double, std::vector<Segment> > segmentPass(const std::vector<int>&,
+														 HugePageVector<double>&,
+														 HugePageVector<int>&) const;
 
-	double expectedTransition(const std::vector<std::string>&,
-							  const std::string&, const std::string&);
-	double expectedEmission(const std::vector<std::string>&,
-							const std::string&, const std::string&);
-	double expectedInitState(const std::vector<std::string>&, const std::string&);
+	void entropyStep(const double*, const double*, std::vector<double>&,
+					 std::vector<double>&) const;
+	void backwardPass(const std::vector<int>&, const std::vector<double>&,
+					  HugePageVector<double>&) const;
+	double forwardTrellis(const std::vector<int>&, HugePageVector<double>&, std::vector<double>&,
+						  double* pathEntropy = NULL) const;
+	double forwardBackward(const std::vector<int>&, HugePageVector<double>&,
+						   HugePageVector<double>&, std::vector<double>&,
+						   double* pathEntropy = NULL) const;
+	void decodePosition(const double*, const double*, size_t, PosteriorDecoding&) const;
+	void decodePosterior(const HugePageVector<double>&, const HugePageVector<double>&, size_t,
+						 PosteriorDecoding&) const;
+	void drawPath(const HugePageVector<double>&, std::mt19937_64&, std::vector<double>&,
+				  std::vector<int>&) const;
+	PosteriorDecoding posteriorPass(const std::vector<int>&, HugePageVector<double>&,
+									HugePageVector<double>&) const;
+	PosteriorDecoding concurrentPosteriorPass(const std::vector<int>&, HugePageVector<double>&,
+											  HugePageVector<double>&) const;
+	QueryResult queryPass(const std::vector<int>&, bool, HugePageVector<double>&,
+						  HugePageVector<double>&, HugePageVector<double>&,
+						  HugePageVector<int>&) const;
+	double accumulate(const std::vector<int>&, BaumWelchStats&,
+					  HugePageVector<double>&, HugePageVector<double>&, std::vector<double>&,
+					  std::vector<double>&, double weight = 1) const;
+	void addExpectedCounts(const std::vector<int>&, const HugePageVector<double>&,
+						   const HugePageVector<double>&, const std::vector<double>&, double,
+						   BaumWelchStats&, std::vector<double>&) const;
+	void updateLogTables();
 
 private:
 	size_t _numOfTimeSteps;
-	std::vector<std::string> _stateNames, _outputNames;
+	std::vector<std::string> _stateNames;
+	std::shared_ptr<const Vocabulary> _vocabulary;
 
 	std::map<std::string, std::map<std::string, double> > _transitions;
 	std::map<std::string, std::map<std::string, double> > _emissions;
 	std::map<std::string, double> _initStates;
+
+	/* Dense row-major copies of the parameters above, indexed by state and output IDs. Large
+	 * models get them backed by huge pages according to the huge page policy. */
+	HugePageVector<double> _a, _b, _pi;
+	/* Their logarithms, for the log-space engines. */
+	HugePageVector<double> _logA, _logB, _logPi;
+	/* Per-NUMA-node copies for engines run with replication, cleared by updateLogTables(). */
+	mutable ReplicaCache<HiddenMarkovModel> _replicas;
 };
 
 
@@ -0,0 +1,85 @@
+#include <sys/mman.h>
+#include "HugePages.hpp"
+
+using namespace std;
+
+
+static const size_t HUGE_PAGE = size_t(2) << 20;
+
+static HugePagePolicy policy = NoHugePages;
+
+
+void setHugePagePolicy(HugePagePolicy newPolicy)
+{
+	policy = newPolicy;
+}
+
+
+HugePagePolicy hugePagePolicy()
+{
+	return policy;
+}
+
+
+/* Maps length bytes, a whole number of huge pages, starting at the returned address, or
+ * returns NULL. With huge pages the mapping is aligned to a huge page boundary. */
+static void* mapBlock(size_t length)
+{
+	if (policy == NoHugePages)
+	{
+		void* block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+						   -1, 0);
+		return (block == MAP_FAILED) ? NULL : block;
+	}
+
+#ifdef MAP_HUGETLB
+	if (policy == ExplicitHugePages)
+	{
+		void* block = mmap(NULL, length, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (block != MAP_FAILED)
+			return block;
+	}
+#endif
+
+	/* Over-map by one huge page so that an aligned block fits, unmap the slack around it and
+	 * let the kernel back it with transparent huge pages. */
+	char* mapping = static_cast<char*>(mmap(NULL, length + HUGE_PAGE, PROT_READ | PROT_WRITE,
+											MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	char* block = reinterpret_cast<char*>(
+		(reinterpret_cast<size_t>(mapping) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+	if (block > mapping)
+		munmap(mapping, block - mapping);
+	munmap(block + length, mapping + HUGE_PAGE - block);
+#ifdef MADV_HUGEPAGE
+	madvise(block, length, MADV_HUGEPAGE);
+#endif
+	return block;
+}
+
+
+void* allocateLarge(size_t bytes)
+{
+	if (bytes < HUGE_PAGE)
+		return ::operator new(bytes);
+
+	void* block = mapBlock((bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+	if (!block)
+		throw bad_alloc();
+	return block;
+}
+
+
+void deallocateLarge(void* block, size_t bytes)
+{
+	if (!block)
+		return;
+
+	if (bytes < HUGE_PAGE)
+		::operator delete(block);
+	else
+		munmap(block, (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+}
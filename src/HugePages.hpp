@@ -0,0 +1,49 @@
+#ifndef GUARD_HUGEPAGES_HPP
+#define GUARD_HUGEPAGES_HPP
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+
+/*
+ * Allocation policy for large parameter and trellis buffers. Blocks of at least 2 MiB are
+ * mapped directly, in whole 2 MiB units, and backed by huge pages on request: transparent huge
+ * pages are requested with madvise(MADV_HUGEPAGE), explicit ones with MAP_HUGETLB, falling
+ * back to transparent huge pages when the hugetlb pool is empty. Smaller blocks always come
+ * from the regular heap, so the size of a block tells how to free it.
+ */
+enum HugePagePolicy { NoHugePages, TransparentHugePages, ExplicitHugePages };
+
+/** Sets the policy for allocations made from now on. */
+void setHugePagePolicy(HugePagePolicy policy);
+HugePagePolicy hugePagePolicy();
+
+void* allocateLarge(size_t bytes);
+/** Frees a block of allocateLarge(bytes), given the same bytes. */
+void deallocateLarge(void* block, size_t bytes);
+
+
+template <typename T>
+struct HugePageAllocator
+{
+	typedef T value_type;
+
+	HugePageAllocator() {}
+	template <typename U> HugePageAllocator(const HugePageAllocator<U>&) {}
+
+	T* allocate(size_t n) { return static_cast<T*>(allocateLarge(n * sizeof(T))); }
+	void deallocate(T* block, size_t n) { deallocateLarge(block, n * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return false; }
+
+/* Vector whose storage follows the huge page policy. */
+template <typename T>
+using HugePageVector = std::vector<T, HugePageAllocator<T> >;
+
+
+#endif
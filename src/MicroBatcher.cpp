@@ -0,0 +1,246 @@
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include "MicroBatcher.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+
+MicroBatcher::MicroBatcher(Query query, size_t maxBatchSize, long maxWaitMicros,
+						   const ExecutionPolicy& policy)
+	: _query(query), _maxBatchSize(max<size_t>(maxBatchSize, 1)),
+	  _maxWait(maxWaitMicros), _policy(policy), _batches(0), _stopping(false)
+{
+	_worker = thread(&MicroBatcher::run, this);
+}
+
+
+MicroBatcher::~MicroBatcher()
+{
+	{
+		lock_guard<mutex> lock(_mutex);
+		_stopping = true;
+	}
+	_ready.notify_one();
+	_worker.join();
+}
+
+
+future<MicroBatcher::Result> MicroBatcher::submit(shared_ptr<const HiddenMarkovModel> hmm,
+												 vector<int> obs)
+{
+	Request req;
+	req.hmm = hmm;
+	req.obs.swap(obs);
+	req.arrival = chrono::steady_clock::now();
+	future<Result> ret = req.result.get_future();
+
+	bool full;
+	{
+		lock_guard<mutex> lock(_mutex);
+		if (_stopping)
+			throw runtime_error("batcher is shutting down");
+
+		_queue.push_back(move(req));
+		full = (_queue.size() == 1 || _queue.size() >= _maxBatchSize);
+	}
+
+	/* Only wake the worker for the first request of a batch or a full one. */
+	if (full)
+		_ready.notify_one();
+
+	return ret;
+}
+
+
+size_t MicroBatcher::batches() const
+{
+	lock_guard<mutex> lock(_mutex);
+	return _batches;
+}
+
+
+void MicroBatcher::run()
+{
+	unique_lock<mutex> lock(_mutex);
+
+	for (;;)
+	{
+		_ready.wait(lock, [this] { return _stopping || !_queue.empty(); });
+		if (_queue.empty())
+			return;
+
+		/* Hold the batch open until it fills up or its oldest request runs out of patience.
+		 * Pending requests are still flushed on shutdown. */
+		auto deadline = _queue.front().arrival + _maxWait;
+		_ready.wait_until(lock, deadline, [this] {
+			return _stopping || _queue.size() >= _maxBatchSize;
+		});
+
+		size_t n = min(_queue.size(), _maxBatchSize);
+		vector<Request> batch;
+		batch.reserve(n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			batch.push_back(move(_queue.front()));
+			_queue.pop_front();
+		}
+		++_batches;
+		lock.unlock();
+
+		/* Run each model's share of the batch through its engine in one go. */
+		map<const HiddenMarkovModel*, vector<size_t> > byModel;
+		for (size_t i = 0; i < n; ++i)
+			byModel[batch[i].hmm.get()].push_back(i);
+
+		for (auto& group : byModel)
+		{
+			const vector<size_t>& members = group.second;
+			vector<vector<int> > observations(members.size());
+			for (size_t i = 0; i < members.size(); ++i)
+				observations[i].swap(batch[members[i]].obs);
+
+			/* A failing engine call fails every request of its group, not the batcher. */
+			try
+			{
+				if (_query == Likelihood)
+				{
+					vector<double> probs = group.first->forward(observations, _policy);
+					for (size_t i = 0; i < members.size(); ++i)
+						batch[members[i]].result.set_value(Result(probs[i], vector<int>()));
+				}
+				else
+				{
+					vector<Result> paths = group.first->viterbi(observations, _policy);
+					for (size_t i = 0; i < members.size(); ++i)
+						batch[members[i]].result.set_value(move(paths[i]));
+				}
+			}
+			catch (...)
+			{
+				exception_ptr error = current_exception();
+				for (size_t i = 0; i < members.size(); ++i)
+				{
+					try
+					{
+						batch[members[i]].result.set_exception(error);
+					}
+					catch (const future_error&)
+					{
+						/* Already answered before the engine failed. */
+					}
+				}
+			}
+		}
+
+		lock.lock();
+	}
+}
+
+
+/* Serves requests from in, resolving the model of each line with resolve, which may consume
+ * leading words of the line. */
+static void serveLines(MicroBatcher& batcher, istream& in, ostream& out,
+					   function<shared_ptr<const HiddenMarkovModel>(vector<string>&)> resolve)
+{
+	/* Results are printed by a separate thread so that reading requests never waits on a
+	 * batch. A pending entry is either a future result or the error for a rejected line. */
+	struct Pending
+	{
+		shared_ptr<const HiddenMarkovModel> hmm;
+		future<MicroBatcher::Result> result;
+		string error;
+	};
+
+	mutex pendingMutex;
+	condition_variable pendingReady;
+	deque<Pending> pending;
+	bool done = false;
+
+	thread printer([&] {
+		for (;;)
+		{
+			Pending cur;
+			{
+				unique_lock<mutex> lock(pendingMutex);
+				pendingReady.wait(lock, [&] { return done || !pending.empty(); });
+				if (pending.empty())
+					return;
+
+				cur = move(pending.front());
+				pending.pop_front();
+			}
+
+			if (!cur.error.empty())
+			{
+				out << "error: " << cur.error << endl;
+				continue;
+			}
+
+			MicroBatcher::Result result;
+			try
+			{
+				result = cur.result.get();
+			}
+			catch (const exception& e)
+			{
+				out << "error: " << e.what() << endl;
+				continue;
+			}
+
+			out << result.first;
+			for (auto stt : result.second)
+				out << " " << cur.hmm->states()[stt];
+			out << endl;
+		}
+	});
+
+	string line;
+	while (getline(in, line))
+	{
+		Pending cur;
+		try
+		{
+			vector<string> words = split<string>(line);
+			cur.hmm = resolve(words);
+			cur.result = batcher.submit(cur.hmm, cur.hmm->intern(words));
+		}
+		catch (const exception& e)
+		{
+			cur.error = e.what();
+		}
+
+		lock_guard<mutex> lock(pendingMutex);
+		pending.push_back(move(cur));
+		pendingReady.notify_one();
+	}
+
+	{
+		lock_guard<mutex> lock(pendingMutex);
+		done = true;
+	}
+	pendingReady.notify_one();
+	printer.join();
+}
+
+
+void serve(MicroBatcher& batcher, shared_ptr<const HiddenMarkovModel> hmm,
+		   istream& in, ostream& out)
+{
+	serveLines(batcher, in, out, [&](vector<string>&) { return hmm; });
+}
+
+
+void serve(MicroBatcher& batcher, ModelRegistry& registry, istream& in, ostream& out)
+{
+	serveLines(batcher, in, out, [&](vector<string>& words) {
+		if (words.empty())
+			throw runtime_error("missing model ID");
+
+		string id = words.front();
+		words.erase(words.begin());
+		return registry.get(id);
+	});
+}
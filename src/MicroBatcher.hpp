@@ -0,0 +1,84 @@
+#ifndef GUARD_MICROBATCHER_HPP
+#define GUARD_MICROBATCHER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "HiddenMarkovModel.hpp"
+#include "ModelRegistry.hpp"
+
+
+/*
+ * Coalesces concurrently submitted scoring requests against resident models into
+ * micro-batches. A batch is dispatched to the batched forward or Viterbi engines as soon as it
+ * holds maxBatchSize requests, or once its oldest request has waited maxWaitMicros. Requests
+ * for different models may share a batch; each model runs its own part of it, under the
+ * batcher's execution policy.
+ */
+class MicroBatcher
+{
+public:
+	enum Query { Likelihood, StatePath };
+	/* Probability of the sequence, and its state path for StatePath queries. */
+	typedef std::pair<double, std::vector<int> > Result;
+
+	MicroBatcher(Query query, size_t maxBatchSize, long maxWaitMicros,
+				 const ExecutionPolicy& policy = ExecutionPolicy());
+	~MicroBatcher();
+
+	Query query() const { return _query; }
+
+	/**
+	 * Queues an observation sequence interned by hmm and returns the future result for this
+	 * caller. Safe to call from multiple threads.
+	 */
+	std::future<Result> submit(std::shared_ptr<const HiddenMarkovModel> hmm, std::vector<int> obs);
+
+	/** Number of batches dispatched so far. */
+	size_t batches() const;
+
+private:
+	struct Request
+	{
+		std::shared_ptr<const HiddenMarkovModel> hmm;
+		std::vector<int> obs;
+		std::promise<Result> result;
+		std::chrono::steady_clock::time_point arrival;
+	};
+
+	void run();
+
+private:
+	Query _query;
+	size_t _maxBatchSize;
+	std::chrono::microseconds _maxWait;
+	ExecutionPolicy _policy;
+
+	mutable std::mutex _mutex;
+	std::condition_variable _ready;
+	std::deque<Request> _queue;
+	size_t _batches;
+	bool _stopping;
+	std::thread _worker;
+};
+
+
+/**
+ * Serves one observation sequence per line of in through the batcher and writes one result
+ * line per request to out, in request order.
+ */
+void serve(MicroBatcher& batcher, std::shared_ptr<const HiddenMarkovModel> hmm,
+		   std::istream& in, std::ostream& out);
+/**
+ * Like above, but the first word of each line is the ID of the registry model to use.
+ */
+void serve(MicroBatcher& batcher, ModelRegistry& registry, std::istream& in, std::ostream& out);
+
+
+#endif
@@ -0,0 +1,109 @@
+#include <chrono>
+#include <ostream>
+#include <stdexcept>
+#include "ModelRegistry.hpp"
+
+using namespace std;
+
+
+ModelRegistry::ModelRegistry(const string& directory, size_t capacity)
+	: _directory(directory), _capacity(max<size_t>(capacity, 1)), _stats()
+{
+}
+
+
+shared_ptr<const HiddenMarkovModel> ModelRegistry::get(const string& id)
+{
+	if (id.empty() || id.find('/') != string::npos || id[0] == '.')
+		throw runtime_error("invalid model ID: " + id);
+
+	{
+		lock_guard<mutex> lock(_mutex);
+
+		auto found = _models.find(id);
+		if (found != _models.end())
+		{
+			++_stats.hits;
+			_lru.splice(_lru.begin(), _lru, found->second.second);
+			return found->second.first;
+		}
+	}
+
+	/* Parse outside the lock so that hot models keep being served meanwhile. If another
+	 * caller loaded the same model in the meantime, its copy wins. */
+	shared_ptr<const HiddenMarkovModel> hmm = load(id);
+
+	lock_guard<mutex> lock(_mutex);
+
+	auto found = _models.find(id);
+	if (found != _models.end())
+		return found->second.first;
+
+	while (_models.size() >= _capacity)
+	{
+		_models.erase(_lru.back());
+		_lru.pop_back();
+		++_stats.evictions;
+	}
+
+	_lru.push_front(id);
+	_models[id] = Entry(hmm, _lru.begin());
+	return hmm;
+}
+
+
+shared_ptr<const HiddenMarkovModel> ModelRegistry::load(const string& id)
+{
+	auto start = chrono::steady_clock::now();
+	shared_ptr<HiddenMarkovModel> hmm = make_shared<HiddenMarkovModel>(_directory + "/" + id + ".hmm");
+	double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+
+	lock_guard<mutex> lock(_mutex);
+
+	/* Share the vocabulary of any live model with the same output symbols, forgetting those
+	 * whose models are all gone. */
+	for (auto i = _vocabularies.begin(); i != _vocabularies.end(); )
+	{
+		if (i->second.expired())
+			i = _vocabularies.erase(i);
+		else
+			++i;
+	}
+
+	weak_ptr<const Vocabulary>& shared = _vocabularies[hmm->outputs()];
+	if (shared_ptr<const Vocabulary> vocabulary = shared.lock())
+		hmm->shareVocabulary(vocabulary);
+	else
+		shared = hmm->vocabulary();
+
+	++_stats.misses;
+	_stats.totalLoadMicros += micros;
+	_stats.maxLoadMicros = max(_stats.maxLoadMicros, micros);
+
+	return hmm;
+}
+
+
+ModelRegistry::Stats ModelRegistry::stats() const
+{
+	lock_guard<mutex> lock(_mutex);
+
+	Stats ret = _stats;
+	ret.resident = _models.size();
+	ret.vocabularies = 0;
+	for (auto& vocabulary : _vocabularies)
+		if (!vocabulary.second.expired())
+			++ret.vocabularies;
+
+	return ret;
+}
+
+
+void printRegistryStats(const ModelRegistry::Stats& stats, ostream& out)
+{
+	out << "models: " << stats.hits << " hits, " << stats.misses << " loads, "
+		<< stats.evictions << " evictions, " << stats.resident << " resident, "
+		<< stats.vocabularies << " vocabularies; load latency "
+		<< (stats.misses ? stats.totalLoadMicros / stats.misses : 0) << " us mean, "
+		<< stats.maxLoadMicros << " us max" << endl;
+}
@@ -0,0 +1,62 @@
+#ifndef GUARD_MODELREGISTRY_HPP
+#define GUARD_MODELREGISTRY_HPP
+
+#include <list>
+#include <ostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "HiddenMarkovModel.hpp"
+
+
+/*
+ * Serves models addressed by ID from a directory of <ID>.hmm files. Models are parsed on first
+ * use and kept in an LRU of at most capacity resident models; the least recently used one is
+ * evicted when a new model is loaded. Callers holding an evicted model keep it alive until they
+ * let go of it. Models with identical output symbols share one vocabulary. Memory is bounded
+ * by capacity rather than by mapping: each resident model owns its parsed tables.
+ */
+class ModelRegistry
+{
+public:
+	struct Stats
+	{
+		size_t hits, misses, evictions, resident, vocabularies;
+		double totalLoadMicros, maxLoadMicros;
+	};
+
+	ModelRegistry(const std::string& directory, size_t capacity);
+
+	/**
+	 * Returns the model with the given ID, loading it if it is not resident.
+	 * Throws if the ID is malformed or the model cannot be loaded.
+	 */
+	std::shared_ptr<const HiddenMarkovModel> get(const std::string& id);
+
+	Stats stats() const;
+
+private:
+	typedef std::pair<std::shared_ptr<const HiddenMarkovModel>,
+					  std::list<std::string>::iterator> Entry;
+
+	std::shared_ptr<const HiddenMarkovModel> load(const std::string& id);
+
+private:
+	std::string _directory;
+	size_t _capacity;
+
+	mutable std::mutex _mutex;
+	std::list<std::string> _lru;	// most recently used first
+	std::map<std::string, Entry> _models;
+	std::map<std::vector<std::string>, std::weak_ptr<const Vocabulary> > _vocabularies;
+	Stats _stats;
+};
+
+
+/** Writes a one-line summary of registry statistics, as the servers print on exit. */
+void printRegistryStats(const ModelRegistry::Stats& stats, std::ostream& out);
+
+
+#endif
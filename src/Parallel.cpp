@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <exception>
+#include <thread>
+#include <vector>
+#include "Parallel.hpp"
+
+using namespace std;
+
+
+unsigned ExecutionPolicy::workers() const
+{
+	if (threads)
+		return threads;
+
+	unsigned cpus = thread::hardware_concurrency();
+	return cpus ? cpus : 1;
+}
+
+
+#ifdef __linux__
+/* Returns the CPUs the process may run on, read when the program starts, before any thread
+ * is pinned; a pinned thread's own mask only holds its CPU. The set is empty if it cannot be
+ * read. */
+static cpu_set_t readProcessAffinity()
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		CPU_ZERO(&allowed);
+	return allowed;
+}
+
+static const cpu_set_t processAffinity = readProcessAffinity();
+#endif
+
+
+/* Pins the calling thread to the worker-th CPU of the process's affinity mask. */
+static void pinWorker(unsigned worker)
+{
+#ifdef __linux__
+	cpu_set_t allowed = processAffinity;
+	if (CPU_COUNT(&allowed) == 0)
+		return;
+
+	unsigned target = worker % CPU_COUNT(&allowed);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+	{
+		if (!CPU_ISSET(cpu, &allowed) || target--)
+			continue;
+
+		cpu_set_t single;
+		CPU_ZERO(&single);
+		CPU_SET(cpu, &single);
+		pthread_setaffinity_np(pthread_self(), sizeof(single), &single);
+		return;
+	}
+#else
+	(void)worker;
+#endif
+}
+
+
+void unpinThread()
+{
+#ifdef __linux__
+	if (CPU_COUNT(&processAffinity) > 0)
+		pthread_setaffinity_np(pthread_self(), sizeof(processAffinity), &processAffinity);
+#endif
+}
+
+
+void runWorkers(const ExecutionPolicy& policy, function<void(unsigned)> body)
+{
+	unsigned n = policy.workers();
+	if (n == 1 && !policy.pin)
+	{
+		body(0);
+		return;
+	}
+
+	vector<exception_ptr> errors(n);
+	vector<thread> workers;
+
+	for (unsigned i = 0; i < n; ++i)
+	{
+		workers.push_back(thread([&, i] {
+			/* Threads inherit their creator's affinity, so unpinned workers started from a
+			 * pinned one are given back the whole process mask. */
+			if (policy.pin)
+				pinWorker(i);
+			else
+				unpinThread();
+
+			try
+			{
+				body(i);
+			}
+			catch (...)
+			{
+				errors[i] = current_exception();
+			}
+		}));
+	}
+
+	for (auto& worker : workers)
+		worker.join();
+
+	for (auto& error : errors)
+		if (error)
+			rethrow_exception(error);
+}
+
+
+ProgressMeter::ProgressMeter(const ExecutionPolicy& policy, size_t totalSequences)
+	: _policy(policy), _total(totalSequences), _done(0), _start(chrono::steady_clock::now()),
+	  _lastReport(_start)
+{
+}
+
+
+void ProgressMeter::advance(size_t n)
+{
+	if (_policy.cancelled())
+		throw Cancelled();
+
+	size_t done = (_done += n);
+	if (!_policy.progress)
+		return;
+
+	/* Only one worker reports at a time; the others carry on. */
+	unique_lock<mutex> lock(_mutex, try_to_lock);
+	if (!lock.owns_lock())
+		return;
+
+	auto now = chrono::steady_clock::now();
+	if (chrono::duration<double>(now - _lastReport).count() < _policy.progressInterval)
+		return;
+
+	_lastReport = now;
+	report(done);
+}
+
+
+void ProgressMeter::finish()
+{
+	if (!_policy.progress)
+		return;
+
+	lock_guard<mutex> lock(_mutex);
+	report(_done);
+}
+
+
+void ProgressMeter::report(size_t sequences)
+{
+	Progress progress;
+	progress.iteration = 0;
+	progress.sequences = sequences;
+	progress.totalSequences = _total;
+	progress.seconds = chrono::duration<double>(chrono::steady_clock::now() - _start).count();
+	progress.sequencesPerSecond = progress.seconds > 0 ? sequences / progress.seconds : 0;
+	progress.logLikelihood = -numeric_limits<double>::infinity();
+
+	_policy.progress(progress);
+}
+
+
+unsigned currentNode()
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned cpu = 0, node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+		return node;
+#endif
+	return 0;
+}
@@ -0,0 +1,316 @@
+#ifndef GUARD_PARALLEL_HPP
+#define GUARD_PARALLEL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "PerfCounters.hpp"
+
+
+/*
+ * Cooperative cancellation flag for long jobs. cancel() only stores to an atomic, so it may be
+ * called from a signal handler; engines check the flag at sequence and iteration boundaries.
+ */
+class CancellationToken
+{
+public:
+	CancellationToken() : _cancelled(false) {}
+
+	void cancel() { _cancelled.store(true); }
+	bool cancelled() const { return _cancelled.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<bool> _cancelled;
+};
+
+/* Thrown by an engine that stopped because its job was cancelled. */
+class Cancelled : public std::runtime_error
+{
+public:
+	Cancelled() : std::runtime_error("cancelled") {}
+};
+
+
+/*
+ * Progress of a scoring or training job. For training, iteration counts from 1 and
+ * logLikelihood is that of the last completed iteration; otherwise they are 0 and -inf.
+ */
+struct Progress
+{
+	size_t iteration;
+	size_t sequences, totalSequences;
+	double seconds, sequencesPerSecond;
+	double logLikelihood;
+};
+
+
+/*
+ * How batch work is spread over worker threads, and how the job is observed.
+ */
+struct ExecutionPolicy
+{
+	ExecutionPolicy()
+		: threads(1), pin(false), replicate(false), cancellation(NULL), progressInterval(0.5) {}
+
+	/* Number of workers; 0 means one per available CPU. */
+	unsigned threads;
+	/* Pin worker i to the i-th CPU this process may run on. */
+	bool pin;
+	/* Give the workers of each NUMA node their own copy of read-only model data. */
+	bool replicate;
+	/* Checked between sequences; when set, the engine throws Cancelled. */
+	const CancellationToken* cancellation;
+	/* Called at most every progressInterval seconds, and once at the end of each pass. Calls
+	 * are serialized. */
+	std::function<void(const Progress&)> progress;
+	double progressInterval;
+
+	unsigned workers() const;
+	bool cancelled() const { return cancellation && cancellation->cancelled(); }
+};
+
+
+/*
+ * Counts finished sequences of one pass over a batch for the policy's progress callback and
+ * checks for cancellation. Shared by all workers of the pass.
+ */
+class ProgressMeter
+{
+public:
+	ProgressMeter(const ExecutionPolicy& policy, size_t totalSequences);
+
+	/** Records n more finished sequences. Throws Cancelled if the job was cancelled. */
+	void advance(size_t n);
+	/** Reports the end of the pass. */
+	void finish();
+
+private:
+	void report(size_t sequences);
+
+private:
+	const ExecutionPolicy& _policy;
+	size_t _total;
+	std::atomic<size_t> _done;
+	std::chrono::steady_clock::time_point _start, _lastReport;
+	std::mutex _mutex;
+};
+
+
+/**
+ * Runs body(worker) on policy.workers() threads and waits for all of them. A single worker
+ * runs on the calling thread. Exceptions thrown by a worker are rethrown here.
+ */
+void runWorkers(const ExecutionPolicy& policy, std::function<void(unsigned)> body);
+
+/**
+ * Lets the calling thread run on any CPU of the process again. Threads inherit the affinity
+ * of the thread that starts them, so helpers started from pinned workers call this.
+ */
+void unpinThread();
+
+/**
+ * Sums statistics over items [0, n) on the policy's workers. add(worker, item, stats) adds
+ * one item's contribution to stats, a partial sum made by make(); Stats must have merge().
+ *
+ * By default each worker merges its partial sum into the total as it finishes, so the
+ * summation order depends on timing and the number of workers. If deterministic, the items are
+ * cut into fixed shards of shardSize items which are each summed in item order and then
+ * combined pairwise, 0+1, 2+3, ..., then 0+2, 4+6, ..., which is bit-identical for any number
+ * of workers. Shards are folded into that tree as they finish, so only the partial sums of
+ * shards still waiting for a neighbour are held, not one per shard.
+ *
+ * The summing is counted as kernel, or kernel-det per shard if deterministic, and the merging
+ * as kernel-reduce in either mode; the scopes do not overlap.
+ */
+template <typename Stats>
+Stats reduceItems(size_t n, const ExecutionPolicy& policy, bool deterministic, size_t shardSize,
+				  const std::string& kernel, const std::function<Stats()>& make,
+				  const std::function<void(unsigned, size_t, Stats&)>& add)
+{
+	static const size_t CHUNK = 16;
+	ProgressMeter meter(policy, n);
+	std::atomic<size_t> next(0);
+	std::string shardKernel = kernel + "-det", reduceKernel = kernel + "-reduce";
+
+	if (!deterministic)
+	{
+		Stats total = make();
+		std::mutex totalMutex;
+
+		runWorkers(policy, [&](unsigned worker) {
+			Stats local = make();
+			{
+				CounterScope counters(kernel.c_str());
+				for (size_t begin; (begin = next.fetch_add(CHUNK)) < n; )
+				{
+					for (size_t i = begin; i < std::min(begin + CHUNK, n); ++i)
+					{
+						add(worker, i, local);
+						meter.advance(1);
+					}
+				}
+			}
+
+			CounterScope counters(reduceKernel.c_str());
+			std::lock_guard<std::mutex> lock(totalMutex);
+			total.merge(local);
+		});
+
+		meter.finish();
+		return total;
+	}
+
+	shardSize = std::max<size_t>(shardSize, 1);
+	size_t shards = std::max<size_t>((n + shardSize - 1) / shardSize, 1);
+
+	/* Node (level, i) of the tree sums shards [i << level, (i + 1) << level). A finished node
+	 * waits here for its sibling; whichever of the two finishes second merges them and moves
+	 * up, so only nodes whose siblings are still running are ever held. */
+	std::map<std::pair<unsigned, size_t>, Stats> waiting;
+	std::mutex waitingMutex;
+	auto fold = [&](Stats stats, size_t shard) {
+		CounterScope counters(reduceKernel.c_str());
+		unsigned level = 0;
+		for (size_t i = shard; (size_t(1) << level) < shards; i /= 2, ++level)
+		{
+			size_t sibling = i ^ 1;
+			if ((sibling << level) >= shards)
+				continue;
+
+			std::unique_lock<std::mutex> lock(waitingMutex);
+			auto other = waiting.find(std::make_pair(level, sibling));
+			if (other == waiting.end())
+			{
+				waiting.insert(std::make_pair(std::make_pair(level, i), std::move(stats)));
+				return;
+			}
+			Stats right = std::move(other->second);
+			waiting.erase(other);
+			lock.unlock();
+
+			/* Merge in shard order, the left node taking the right one. */
+			if (i % 2 == 0)
+				stats.merge(right);
+			else
+			{
+				right.merge(stats);
+				stats = std::move(right);
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(waitingMutex);
+		waiting.insert(std::make_pair(std::make_pair(level, size_t(0)), std::move(stats)));
+	};
+
+	runWorkers(policy, [&](unsigned worker) {
+		for (size_t shard; (shard = next.fetch_add(1)) < shards; )
+		{
+			Stats partial = make();
+			{
+				CounterScope counters(shardKernel.c_str());
+				for (size_t i = shard * shardSize; i < std::min((shard + 1) * shardSize, n); ++i)
+				{
+					add(worker, i, partial);
+					meter.advance(1);
+				}
+			}
+			fold(std::move(partial), shard);
+		}
+	});
+	meter.finish();
+
+	return std::move(waiting.begin()->second);
+}
+
+
+/** Returns the NUMA node of the CPU the calling thread is running on. */
+unsigned currentNode();
+
+
+/*
+ * Per-NUMA-node copies of a read-only object. The first worker asking for the copy of its node
+ * makes it, so that under the default first-touch policy the copy's memory is allocated on that
+ * node. Pin the workers so they stay there. Without replication every worker gets the original.
+ */
+template <typename T>
+class NodeReplicas
+{
+public:
+	NodeReplicas(const T& original, bool replicate) : _original(original), _replicate(replicate) {}
+
+	const T& local()
+	{
+		if (!_replicate)
+			return _original;
+
+		unsigned node = currentNode();
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		std::shared_ptr<const T>& copy = _copies[node];
+		if (!copy)
+			copy = std::make_shared<const T>(_original);
+		return *copy;
+	}
+
+private:
+	const T& _original;
+	bool _replicate;
+	std::mutex _mutex;
+	std::map<unsigned, std::shared_ptr<const T> > _copies;
+};
+
+
+/*
+ * The node replicas of a model, kept by the model itself so that they are made once and not
+ * on every engine call. The model must clear() them whenever its parameters change. Copying a
+ * model does not copy its replicas, which mirror the original.
+ */
+template <typename T>
+class ReplicaCache
+{
+public:
+	ReplicaCache() {}
+	ReplicaCache(const ReplicaCache&) {}
+	ReplicaCache& operator=(const ReplicaCache&) { clear(); return *this; }
+
+	/**
+	 * Returns the calling worker's copy of original, the model owning this cache, or original
+	 * itself without replication.
+	 */
+	const T& local(const T& original, bool replicate)
+	{
+		if (!replicate)
+			return original;
+
+		std::shared_ptr<NodeReplicas<T> > replicas;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!_replicas)
+				_replicas = std::make_shared<NodeReplicas<T> >(original, true);
+			replicas = _replicas;
+		}
+		return replicas->local();
+	}
+
+	/** Drops the replicas; the next engine call makes new ones. */
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_replicas.reset();
+	}
+
+private:
+	std::mutex _mutex;
+	std::shared_ptr<NodeReplicas<T> > _replicas;
+};
+
+
+#endif
@@ -0,0 +1,194 @@
+#include <unistd.h>
+#include <cstring>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include "PerfCounters.hpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+
+static bool enabled = false;
+
+struct KernelTotals
+{
+	KernelTotals() : calls(0), seconds(0)
+	{
+		for (int e = 0; e < NumCounterEvents; ++e)
+		{
+			counts[e] = 0;
+			available[e] = true;
+		}
+	}
+
+	uint64_t calls;
+	double seconds;
+	uint64_t counts[NumCounterEvents];
+	bool available[NumCounterEvents];
+};
+
+static mutex totalsMutex;
+static map<string, KernelTotals> totals;
+
+
+/* The counters of one thread, opened the first time that thread enters a scope. Each event has
+ * its own descriptor so that one unsupported event does not take the others down with it. */
+struct ThreadCounters
+{
+	ThreadCounters()
+	{
+		for (int e = 0; e < NumCounterEvents; ++e)
+			fds[e] = open(CounterEvent(e));
+	}
+
+	~ThreadCounters()
+	{
+		for (int e = 0; e < NumCounterEvents; ++e)
+			if (fds[e] >= 0)
+				close(fds[e]);
+	}
+
+	static int open(CounterEvent event)
+	{
+#if defined(__linux__) && defined(__NR_perf_event_open)
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		switch (event)
+		{
+		case Cycles:		attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+		case Instructions:	attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+		case CacheMisses:	attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+		case BranchMisses:	attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+		case TlbMisses:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+						  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		default:
+			return -1;
+		}
+
+		return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+		(void)event;
+		return -1;
+#endif
+	}
+
+	bool read(CounterEvent event, uint64_t& value) const
+	{
+		return fds[event] >= 0 && ::read(fds[event], &value, sizeof(value)) == sizeof(value);
+	}
+
+	int fds[NumCounterEvents];
+};
+
+static ThreadCounters& threadCounters()
+{
+	static thread_local ThreadCounters counters;
+	return counters;
+}
+
+
+void enableCounters(bool on)
+{
+	enabled = on;
+}
+
+
+bool countersEnabled()
+{
+	return enabled;
+}
+
+
+CounterScope::CounterScope(const char* kernel)
+	: _kernel(kernel), _active(enabled)
+{
+	if (!_active)
+		return;
+
+	ThreadCounters& counters = threadCounters();
+	for (int e = 0; e < NumCounterEvents; ++e)
+		if (!counters.read(CounterEvent(e), _start[e]))
+			_start[e] = 0;
+
+	_begin = chrono::steady_clock::now();
+}
+
+
+CounterScope::~CounterScope()
+{
+	if (!_active)
+		return;
+
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - _begin).count();
+
+	ThreadCounters& counters = threadCounters();
+	uint64_t end[NumCounterEvents];
+	bool available[NumCounterEvents];
+	for (int e = 0; e < NumCounterEvents; ++e)
+		available[e] = counters.read(CounterEvent(e), end[e]);
+
+	lock_guard<mutex> lock(totalsMutex);
+	KernelTotals& kernel = totals[_kernel];
+	++kernel.calls;
+	kernel.seconds += seconds;
+
+	for (int e = 0; e < NumCounterEvents; ++e)
+	{
+		if (available[e])
+			kernel.counts[e] += end[e] - _start[e];
+		else
+			kernel.available[e] = false;
+	}
+}
+
+
+void reportCounters(ostream& out)
+{
+	static const char* names[NumCounterEvents] = {
+		"cycles", "instructions", "cache-misses", "branch-misses", "dTLB-misses"
+	};
+
+	lock_guard<mutex> lock(totalsMutex);
+
+	out << left << setw(12) << "kernel" << right << setw(8) << "calls" << setw(12) << "seconds";
+	for (int e = 0; e < NumCounterEvents; ++e)
+		out << setw(15) << names[e];
+	out << setw(8) << "IPC" << endl;
+
+	for (auto& kernel : totals)
+	{
+		const KernelTotals& t = kernel.second;
+		out << left << setw(12) << kernel.first << right << setw(8) << t.calls
+			<< setw(12) << fixed << setprecision(6) << t.seconds;
+		out.unsetf(ios_base::floatfield);
+
+		for (int e = 0; e < NumCounterEvents; ++e)
+		{
+			if (t.available[e])
+				out << setw(15) << t.counts[e];
+			else
+				out << setw(15) << "-";
+		}
+
+		if (t.available[Cycles] && t.available[Instructions] && t.counts[Cycles])
+			out << setw(8) << setprecision(3) << double(t.counts[Instructions]) / t.counts[Cycles];
+		else
+			out << setw(8) << "-";
+		out << setprecision(6) << endl;
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef GUARD_PERFCOUNTERS_HPP
+#define GUARD_PERFCOUNTERS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+
+/*
+ * Optional per-kernel performance counters. While enabled, every CounterScope measures wall
+ * time and, through perf_event_open, the cycles, instructions, cache misses, branch misses and
+ * dTLB load misses of the calling thread, and adds them to the totals of its kernel. Events
+ * the kernel or hardware does not support are reported as unavailable.
+ */
+enum CounterEvent { Cycles, Instructions, CacheMisses, BranchMisses, TlbMisses, NumCounterEvents };
+
+void enableCounters(bool enabled);
+bool countersEnabled();
+
+/** Writes a table of the totals collected so far for each kernel. */
+void reportCounters(std::ostream& out);
+
+
+class CounterScope
+{
+public:
+	CounterScope(const char* kernel);
+	~CounterScope();
+
+private:
+	CounterScope(const CounterScope&);
+	CounterScope& operator=(const CounterScope&);
+
+private:
+	const char* _kernel;
+	bool _active;
+	uint64_t _start[NumCounterEvents];
+	std::chrono::steady_clock::time_point _begin;
+};
+
+
+#endif
@@ -0,0 +1,227 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include "HiddenMarkovModel.hpp"
+#include "ResultFile.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+
+static const char RESULT_MAGIC[8] = { 'H', 'M', 'M', 'R', 'S', 'L', 'T', '\0' };
+static const uint32_t RESULT_VERSION = 1;
+
+
+static uint64_t align8(uint64_t at)
+{
+	return (at + 7) & ~uint64_t(7);
+}
+
+
+/* Sets the column offsets of header from its counts and columns. */
+static void layOut(ResultHeader& header)
+{
+	uint64_t end = sizeof(ResultHeader) + (header.sequences + 1) * sizeof(uint64_t);
+	header.logLikelihoodAt = end;
+	end += header.sequences * sizeof(double);
+	header.pathsAt = header.posteriorsAt = 0;
+	if (header.columns & ResultWriter::Paths)
+	{
+		end += header.sequences * sizeof(double);
+		header.pathsAt = end;
+		end = align8(end + header.positions * sizeof(int32_t));
+	}
+	if (header.columns & ResultWriter::Posteriors)
+		header.posteriorsAt = end;
+}
+
+
+/* Returns the size of a result file with the given header. */
+static uint64_t fileSize(const ResultHeader& header)
+{
+	if (header.columns & ResultWriter::Posteriors)
+		return header.posteriorsAt + header.positions * header.states * sizeof(double);
+	if (header.columns & ResultWriter::Paths)
+		return align8(header.pathsAt + header.positions * sizeof(int32_t));
+	return header.logLikelihoodAt + header.sequences * sizeof(double);
+}
+
+
+ResultWriter::ResultWriter(const string& filename, const vector<size_t>& lengths, size_t states,
+						   unsigned columns)
+{
+	static_assert(sizeof(ResultHeader) == 64, "result header must be 64 bytes");
+
+	/* The magic stays zero until commit(), so that readers reject a file still being written
+	 * or left behind by a failed run. */
+	ResultHeader header;
+	memset(&header, 0, sizeof(header));
+	header.version = RESULT_VERSION;
+	header.columns = columns;
+	header.sequences = lengths.size();
+	header.states = states;
+	for (auto length : lengths)
+		header.positions += length;
+	layOut(header);
+
+	int fd = open(filename.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		throw runtime_error("cannot create result file " + filename + ": " + strerror(errno));
+
+	/* The file is sized up front, so that every slot of it can be mapped at once. */
+	_size = fileSize(header);
+	if (ftruncate(fd, _size) != 0)
+	{
+		close(fd);
+		throw runtime_error("cannot size result file " + filename + ": " + strerror(errno));
+	}
+
+	_base = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (_base == MAP_FAILED)
+		throw runtime_error("cannot map result file " + filename + ": " + strerror(errno));
+
+	char* base = static_cast<char*>(_base);
+	_header = new (base) ResultHeader(header);
+	uint64_t* offsets = reinterpret_cast<uint64_t*>(base + sizeof(ResultHeader));
+	offsets[0] = 0;
+	for (size_t i = 0; i < lengths.size(); ++i)
+		offsets[i+1] = offsets[i] + lengths[i];
+
+	_offsets = offsets;
+	_logLikelihood = reinterpret_cast<double*>(base + header.logLikelihoodAt);
+	_pathLogProbability = _logLikelihood + header.sequences;
+	_paths = reinterpret_cast<int32_t*>(base + header.pathsAt);
+	_posteriors = reinterpret_cast<double*>(base + header.posteriorsAt);
+}
+
+
+ResultWriter::~ResultWriter()
+{
+	munmap(_base, _size);
+}
+
+
+void ResultWriter::commit()
+{
+	if (msync(_base, _size, MS_SYNC) != 0)
+		throw runtime_error(string("cannot write result file: ") + strerror(errno));
+
+	memcpy(_header->magic, RESULT_MAGIC, sizeof(RESULT_MAGIC));
+	if (msync(_base, sizeof(ResultHeader), MS_SYNC) != 0)
+		throw runtime_error(string("cannot write result file: ") + strerror(errno));
+}
+
+
+void ResultWriter::write(size_t i, double logLikelihood, double pathLogProbability,
+						 const int32_t* path, const double* posterior)
+{
+	_logLikelihood[i] = logLikelihood;
+	if (_header->columns & Paths)
+	{
+		_pathLogProbability[i] = pathLogProbability;
+		copy(path, path + length(i), this->path(i));
+	}
+	if (_header->columns & Posteriors)
+		copy(posterior, posterior + length(i) * _header->states, this->posterior(i));
+}
+
+
+ResultFile::ResultFile(const string& filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw runtime_error("cannot open result file " + filename + ": " + strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(ResultHeader))
+	{
+		close(fd);
+		throw runtime_error("not a result file: " + filename);
+	}
+
+	_size = st.st_size;
+	_base = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (_base == MAP_FAILED)
+		throw runtime_error("cannot map result file " + filename + ": " + strerror(errno));
+
+	_header = static_cast<const ResultHeader*>(_base);
+	_offsets = reinterpret_cast<const uint64_t*>(static_cast<const char*>(_base)
+												 + sizeof(ResultHeader));
+	if (!valid())
+	{
+		munmap(_base, _size);
+		throw runtime_error("not a result file: " + filename);
+	}
+
+	const char* base = static_cast<const char*>(_base);
+	_logLikelihood = reinterpret_cast<const double*>(base + _header->logLikelihoodAt);
+	_pathLogProbability = _logLikelihood + _header->sequences;
+	_paths = reinterpret_cast<const int32_t*>(base + _header->pathsAt);
+	_posteriors = reinterpret_cast<const double*>(base + _header->posteriorsAt);
+}
+
+
+/* Checks the header against the layout its counts imply, before anything is read through its
+ * offsets, and that the sequences tile the positions. */
+bool ResultFile::valid() const
+{
+	if (memcmp(_header->magic, RESULT_MAGIC, sizeof(RESULT_MAGIC)) != 0
+		|| _header->version != RESULT_VERSION
+		|| (_header->columns & ~unsigned(ResultWriter::Paths | ResultWriter::Posteriors)) != 0)
+		return false;
+
+	/* Bound the counts by the file size first, so that the layout cannot overflow. */
+	uint64_t sequences = _header->sequences, positions = _header->positions;
+	if (sequences >= _size / sizeof(uint64_t) || positions > _size / sizeof(int32_t)
+		|| ((_header->columns & ResultWriter::Posteriors) && positions > 0
+			&& _header->states > _size / sizeof(double) / positions))
+		return false;
+
+	ResultHeader expected = *_header;
+	layOut(expected);
+	if (expected.logLikelihoodAt != _header->logLikelihoodAt
+		|| expected.pathsAt != _header->pathsAt || expected.posteriorsAt != _header->posteriorsAt
+		|| fileSize(expected) != _size)
+		return false;
+
+	if (_offsets[0] != 0 || _offsets[sequences] != positions)
+		return false;
+	for (size_t i = 0; i < sequences; ++i)
+		if (_offsets[i+1] < _offsets[i])
+			return false;
+	return true;
+}
+
+
+ResultFile::~ResultFile()
+{
+	munmap(_base, _size);
+}
+
+
+void writeResults(const HiddenMarkovModel& hmm, const vector<string>& obsFilenames,
+				  const string& filename, unsigned columns, const ExecutionPolicy& policy)
+{
+	vector<vector<int> > corpus;
+	for (const auto& obsFilename : obsFilenames)
+	{
+		vector<vector<int> > file = hmm.intern(parseObsFile(obsFilename));
+		corpus.insert(corpus.end(), file.begin(), file.end());
+	}
+
+	vector<size_t> lengths;
+	for (const auto& obs : corpus)
+		lengths.push_back(obs.size());
+
+	ResultWriter writer(filename, lengths, hmm.states().size(), columns);
+	hmm.score(corpus, writer, policy);
+	writer.commit();
+}
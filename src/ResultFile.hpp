@@ -0,0 +1,157 @@
+#ifndef GUARD_RESULTFILE_HPP
+#define GUARD_RESULTFILE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Parallel.hpp"
+
+
+class HiddenMarkovModel;
+
+
+/*
+ * Columnar binary results of scoring a corpus, for analytics that would otherwise re-parse the
+ * text output. A 64-byte header is followed by 8-byte aligned columns:
+ *
+ *   offsets              uint64[sequences + 1]   first position of each sequence
+ *   logLikelihood        double[sequences]
+ *   pathLogProbability   double[sequences]            with paths
+ *   paths                int32[positions]             with paths, Viterbi state IDs
+ *   posteriors           double[positions * states]   with posteriors, P(state | sequence)
+ *
+ * Positions run over all sequences in corpus order, so sequence i covers positions
+ * [offsets[i], offsets[i+1]). Values are in host byte order. Sequences no path can produce
+ * have -inf scores, state IDs -1 and zero posteriors. The magic number is written last, once
+ * every column is complete.
+ */
+struct ResultHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t columns;
+	uint64_t sequences;
+	uint64_t positions;
+	uint32_t states;
+	uint32_t reserved;
+	/* Byte offsets of columns; those of absent columns are 0. The offsets column is right
+	 * after the header and pathLogProbability right after logLikelihood. */
+	uint64_t logLikelihoodAt;
+	uint64_t pathsAt;
+	uint64_t posteriorsAt;
+};
+
+
+/*
+ * Writes a result file. The layout follows from the sequence lengths, so the file is sized,
+ * its offsets written and the whole of it mapped up front. Every sequence then has a fixed
+ * slot in each column, and workers store their results straight into the mapping, from any
+ * number of threads and in any order, with no reorder buffer and no copies.
+ */
+class ResultWriter
+{
+public:
+	enum Column { Paths = 1, Posteriors = 2 };
+
+	/**
+	 * Creates (or replaces) filename for sequences of the given lengths, with the optional
+	 * columns in columns, a set of Column bits. states is the number of model states.
+	 */
+	ResultWriter(const std::string& filename, const std::vector<size_t>& lengths, size_t states,
+				 unsigned columns);
+	~ResultWriter();
+
+	unsigned columns() const { return _header->columns; }
+	size_t states() const { return _header->states; }
+
+	size_t length(size_t i) const { return _offsets[i+1] - _offsets[i]; }
+
+	/* Slots of sequence i in the mapping; those of absent columns must not be used. */
+	double& logLikelihood(size_t i) { return _logLikelihood[i]; }
+	double& pathLogProbability(size_t i) { return _pathLogProbability[i]; }
+	/** Returns room for the length(i) state IDs of sequence i. */
+	int32_t* path(size_t i) { return _paths + _offsets[i]; }
+	/** Returns room for length(i) rows of states() posterior probabilities of sequence i. */
+	double* posterior(size_t i) { return _posteriors + _offsets[i] * _header->states; }
+
+	/**
+	 * Copies the results of sequence i into its slots. path holds length(i) state IDs and
+	 * posterior length(i) rows of states() probabilities; either is ignored if its column is
+	 * absent.
+	 */
+	void write(size_t i, double logLikelihood, double pathLogProbability, const int32_t* path,
+			   const double* posterior);
+	/**
+	 * Flushes the results and then writes the header's magic number, which marks the file as
+	 * complete. Call it once every slot is filled; until then readers reject the file.
+	 */
+	void commit();
+
+private:
+	ResultWriter(const ResultWriter&);
+	ResultWriter& operator=(const ResultWriter&);
+
+private:
+	void* _base;
+	size_t _size;
+	ResultHeader* _header;
+	const uint64_t* _offsets;
+	double* _logLikelihood;
+	double* _pathLogProbability;
+	int32_t* _paths;
+	double* _posteriors;
+};
+
+
+/*
+ * Read-only view of a result file through a memory mapping. Arrays point into the mapping
+ * and stay valid while the view lives. Files that are incomplete, or whose header does not
+ * match their size and layout, are rejected.
+ */
+class ResultFile
+{
+public:
+	ResultFile(const std::string& filename);
+	~ResultFile();
+
+	size_t size() const { return _header->sequences; }
+	size_t states() const { return _header->states; }
+	bool hasPaths() const { return _header->columns & ResultWriter::Paths; }
+	bool hasPosteriors() const { return _header->columns & ResultWriter::Posteriors; }
+
+	size_t length(size_t i) const { return _offsets[i+1] - _offsets[i]; }
+	double logLikelihood(size_t i) const { return _logLikelihood[i]; }
+	double pathLogProbability(size_t i) const { return _pathLogProbability[i]; }
+	/** Returns the length(i) state IDs of sequence i. */
+	const int32_t* path(size_t i) const { return _paths + _offsets[i]; }
+	/** Returns length(i) rows of states() posterior probabilities of sequence i. */
+	const double* posterior(size_t i) const { return _posteriors + _offsets[i] * states(); }
+
+private:
+	ResultFile(const ResultFile&);
+	ResultFile& operator=(const ResultFile&);
+
+	bool valid() const;
+
+private:
+	void* _base;
+	size_t _size;
+	const ResultHeader* _header;
+	const uint64_t* _offsets;
+	const double* _logLikelihood;
+	const double* _pathLogProbability;
+	const int32_t* _paths;
+	const double* _posteriors;
+};
+
+
+/**
+ * Scores the sequences of the given .obs files, in order, with hmm and writes their results
+ * to filename with the optional columns in columns.
+ */
+void writeResults(const HiddenMarkovModel& hmm, const std::vector<std::string>& obsFilenames,
+				  const std::string& filename, unsigned columns,
+				  const ExecutionPolicy& policy = ExecutionPolicy());
+
+
+#endif
@@ -0,0 +1,662 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include "PerfCounters.hpp"
+#include "SecondOrderHiddenMarkovModel.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+
+/* Expected counts of one Baum-Welch E-step. */
+struct SecondOrderHiddenMarkovModel::Stats
+{
+	Stats(size_t N, size_t M)
+		: initial(N), first(N*N), second(N*N*N), emissions(N*M), logLikelihood(0), sequences(0)
+	{
+	}
+
+	void merge(const Stats& other)
+	{
+		for (size_t i = 0; i < initial.size(); ++i)
+			initial[i] += other.initial[i];
+		for (size_t i = 0; i < first.size(); ++i)
+			first[i] += other.first[i];
+		for (size_t i = 0; i < second.size(); ++i)
+			second[i] += other.second[i];
+		for (size_t i = 0; i < emissions.size(); ++i)
+			emissions[i] += other.emissions[i];
+
+		logLikelihood += other.logLikelihood;
+		sequences += other.sequences;
+	}
+
+	vector<double> initial, first, second, emissions;
+	double logLikelihood;
+	size_t sequences;
+};
+
+
+SecondOrderHiddenMarkovModel::SecondOrderHiddenMarkovModel(const string& filename)
+{
+	ifstream file(filename);
+	if (!file.is_open())
+		throw runtime_error("file not found: " + string(filename));
+
+	/* Same layout as a first-order .hmm file, followed by the "a2:" section. */
+	string line;
+
+	getline(file, line);
+	vector<int> sizes = split<int>(line);
+	_numOfTimeSteps = sizes[2];
+
+	getline(file, line);
+	_stateNames = split<string>(line);
+
+	getline(file, line);
+	_vocabulary = make_shared<Vocabulary>(split<string>(line));
+
+	size_t N = _stateNames.size(), M = outputs().size();
+	_pi.resize(N);
+	_a1.resize(N*N);
+	_a2.resize(N*N*N);
+	_b.resize(N*M);
+
+	/* Reads rows of the section labelled label into params, row by row. */
+	auto section = [&](const string& label, HugePageVector<double>& params, size_t rows,
+					   size_t cols) {
+		while (getline(file, line) && split<string>(line) != vector<string>(1, label))
+			;
+		if (!file)
+			throw runtime_error("missing " + label + " section in " + filename);
+
+		for (size_t r = 0; r < rows; ++r)
+		{
+			getline(file, line);
+			vector<double> curLine = split<double>(line);
+			if (curLine.size() < cols)
+				throw runtime_error("short row in " + label + " section of " + filename);
+
+			copy(curLine.begin(), curLine.begin() + cols, params.begin() + r*cols);
+		}
+	};
+
+	section("a:", _a1, N, N);
+	section("b:", _b, N, M);
+	section("pi:", _pi, 1, N);
+	section("a2:", _a2, N*N, N);
+	updateLogTables();
+}
+
+
+/* Precomputes the logarithms of the parameters, so that log() stays out of the O(N^3) inner
+ * loop of the Viterbi engine, and drops the node replicas of the old parameters. */
+void SecondOrderHiddenMarkovModel::updateLogTables()
+{
+	auto logs = [](const HugePageVector<double>& params, HugePageVector<double>& ret) {
+		ret.resize(params.size());
+		transform(params.begin(), params.end(), ret.begin(), [](double p) { return log(p); });
+	};
+
+	_replicas.clear();
+	logs(_pi, _logPi);
+	logs(_a1, _logA1);
+	logs(_a2, _logA2);
+	logs(_b, _logB);
+}
+
+
+bool SecondOrderHiddenMarkovModel::isSecondOrder(const string& filename)
+{
+	ifstream file(filename);
+	string line;
+
+	while (getline(file, line))
+		if (split<string>(line) == vector<string>(1, "a2:"))
+			return true;
+
+	return false;
+}
+
+
+vector<int> SecondOrderHiddenMarkovModel::intern(const vector<string>& obs) const
+{
+	vector<int> ret;
+	ret.reserve(obs.size());
+
+	for (auto out : obs)
+	{
+		auto id = _vocabulary->ids.find(out);
+		if (id == _vocabulary->ids.end())
+			throw runtime_error("No such output: " + out);
+
+		ret.push_back(id->second);
+	}
+
+	return ret;
+}
+
+
+/* Scaled forward algorithm over pair states. alpha is a scratch buffer reused between calls.
+ * Returns the log-likelihood of obs, or -inf if it cannot be produced by this model. */
+double SecondOrderHiddenMarkovModel::forwardPass(const vector<int>& obs,
+												 HugePageVector<double>& alpha) const
+{
+	size_t N = _stateNames.size(), M = outputs().size(), NN = N*N, T = obs.size();
+	const double none = -numeric_limits<double>::infinity();
+	if (T == 0)
+		return 0;
+
+	alpha.resize(2*NN + N);
+	double* single = &alpha[2*NN];
+	double* cur = &alpha[0];
+	double* next = &alpha[NN];
+
+	/* t = 0 has no predecessor yet; only single states. */
+	double scale = 0;
+	for (size_t i = 0; i < N; ++i)
+	{
+		single[i] = _pi[i] * _b[i*M + obs[0]];
+		scale += single[i];
+	}
+	if (scale == 0)
+		return none;
+
+	double logLikelihood = log(scale);
+	for (size_t i = 0; i < N; ++i)
+		single[i] /= scale;
+	if (T == 1)
+		return logLikelihood;
+
+	/* t = 1 enters pair (s_0, s_1) through the first-order transitions. */
+	scale = 0;
+	for (size_t i = 0; i < N; ++i)
+	{
+		for (size_t j = 0; j < N; ++j)
+		{
+			cur[i*N + j] = single[i] * _a1[i*N + j] * _b[j*M + obs[1]];
+			scale += cur[i*N + j];
+		}
+	}
+
+	for (size_t t = 2; ; ++t)
+	{
+		if (scale == 0)
+			return none;
+
+		logLikelihood += log(scale);
+		for (size_t p = 0; p < NN; ++p)
+			cur[p] /= scale;
+
+		if (t == T)
+			break;
+
+		/* Pair (i, j) only reaches the N pairs (j, k). */
+		fill(next, next + NN, 0.0);
+		for (size_t i = 0; i < N; ++i)
+		{
+			for (size_t j = 0; j < N; ++j)
+			{
+				double p = cur[i*N + j];
+				if (p == 0)
+					continue;
+
+				const double* row = &_a2[(i*N + j)*N];
+				double* dst = &next[j*N];
+				for (size_t k = 0; k < N; ++k)
+					dst[k] += p * row[k];
+			}
+		}
+
+		scale = 0;
+		for (size_t j = 0; j < N; ++j)
+		{
+			for (size_t k = 0; k < N; ++k)
+			{
+				next[j*N + k] *= _b[k*M + obs[t]];
+				scale += next[j*N + k];
+			}
+		}
+		swap(cur, next);
+	}
+
+	return logLikelihood;
+}
+
+
+vector<double> SecondOrderHiddenMarkovModel::forward(const string& filename,
+													 const ExecutionPolicy& policy) const
+{
+	vector<vector<string> > observations = parseObsFile(filename);
+	if (observations.empty())
+		throw runtime_error("observation file is empty");
+
+	vector<vector<int> > batch;
+	for (auto& obs : observations)
+		batch.push_back(intern(obs));
+
+	return forward(batch, policy);
+}
+
+
+/* Hands out the indices of a batch to workers in small chunks. */
+static const size_t CHUNK = 16;
+
+vector<double> SecondOrderHiddenMarkovModel::forward(const vector<vector<int> >& batch,
+													 const ExecutionPolicy& policy) const
+{
+	vector<double> ret(batch.size());
+	ProgressMeter meter(policy, batch.size());
+	atomic<size_t> next(0);
+
+	runWorkers(policy, [&](unsigned) {
+		const SecondOrderHiddenMarkovModel& hmm = _replicas.local(*this, policy.replicate);
+		HugePageVector<double> alpha;
+		CounterScope counters("forward2");
+
+		for (size_t begin; (begin = next.fetch_add(CHUNK)) < batch.size(); )
+		{
+			for (size_t i = begin; i < min(begin + CHUNK, batch.size()); ++i)
+			{
+				ret[i] = exp(hmm.forwardPass(batch[i], alpha));
+				meter.advance(1);
+			}
+		}
+	});
+
+	meter.finish();
+	return ret;
+}
+
+
+/* Log-space Viterbi over pair states. backptr[t*N*N + j*N + k] is the state at t-2 on the best
+ * path into pair (j, k) at t. Returns the log probability of the best path and its state
+ * IDs; the path is empty if no path can be built. */
+pair<double, vector<int> > SecondOrderHiddenMarkovModel::viterbiPass(const vector<int>& obs,
+																	 HugePageVector<double>& delta,
+																	 HugePageVector<int>& backptr) const
+{
+	size_t N = _stateNames.size(), M = outputs().size(), NN = N*N, T = obs.size();
+	const double none = -numeric_limits<double>::infinity();
+	if (T == 0)
+		return make_pair(0.0, vector<int>());
+
+	delta.resize(2*NN + N);
+	double* single = &delta[2*NN];
+	double* cur = &delta[0];
+	double* next = &delta[NN];
+
+	for (size_t i = 0; i < N; ++i)
+		single[i] = _logPi[i] + _logB[i*M + obs[0]];
+
+	if (T == 1)
+	{
+		size_t best = max_element(single, single + N) - single;
+		if (single[best] == none)
+			return make_pair(none, vector<int>());
+		return make_pair(single[best], vector<int>(1, best));
+	}
+
+	for (size_t i = 0; i < N; ++i)
+		for (size_t j = 0; j < N; ++j)
+			cur[i*N + j] = single[i] + _logA1[i*N + j] + _logB[j*M + obs[1]];
+
+	backptr.resize(T*NN);
+	for (size_t t = 2; t < T; ++t)
+	{
+		/* Ties go to the lowest state ID. */
+		fill(next, next + NN, none);
+		for (size_t i = 0; i < N; ++i)
+		{
+			for (size_t j = 0; j < N; ++j)
+			{
+				double p = cur[i*N + j];
+				if (p == none)
+					continue;
+
+				const double* row = &_logA2[(i*N + j)*N];
+				for (size_t k = 0; k < N; ++k)
+				{
+					double cand = p + row[k];
+					if (cand > next[j*N + k])
+					{
+						next[j*N + k] = cand;
+						backptr[t*NN + j*N + k] = i;
+					}
+				}
+			}
+		}
+
+		for (size_t j = 0; j < N; ++j)
+			for (size_t k = 0; k < N; ++k)
+				next[j*N + k] += _logB[k*M + obs[t]];
+		swap(cur, next);
+	}
+
+	size_t best = max_element(cur, cur + NN) - cur;
+	if (cur[best] == none)
+		return make_pair(none, vector<int>());
+
+	vector<int> path(T);
+	path[T-2] = best / N;
+	path[T-1] = best % N;
+	for (size_t t = T-1; t >= 2; --t)
+		path[t-2] = backptr[t*NN + path[t-1]*N + path[t]];
+
+	return make_pair(cur[best], path);
+}
+
+
+vector<pair<double, vector<string> > >
+SecondOrderHiddenMarkovModel::viterbi(const string& filename, const ExecutionPolicy& policy) const
+{
+	vector<vector<string> > observations = parseObsFile(filename);
+	if (observations.empty())
+		throw runtime_error("observation file is empty");
+
+	vector<vector<int> > batch;
+	for (auto& obs : observations)
+		batch.push_back(intern(obs));
+
+	vector<pair<double, vector<string> > > ret;
+
+	/* Translate each state ID path back to state names. */
+	for (auto result : viterbi(batch, policy))
+	{
+		vector<string> path;
+		for (auto stt : result.second)
+			path.push_back(_stateNames[stt]);
+
+		ret.push_back(make_pair(result.first, path));
+	}
+
+	return ret;
+}
+
+
+vector<pair<double, vector<int> > >
+SecondOrderHiddenMarkovModel::viterbi(const vector<vector<int> >& batch,
+									  const ExecutionPolicy& policy) const
+{
+	vector<pair<double, vector<int> > > ret(batch.size());
+	ProgressMeter meter(policy, batch.size());
+	atomic<size_t> next(0);
+
+	runWorkers(policy, [&](unsigned) {
+		const SecondOrderHiddenMarkovModel& hmm = _replicas.local(*this, policy.replicate);
+		HugePageVector<double> delta;
+		HugePageVector<int> backptr;
+		CounterScope counters("viterbi2");
+
+		for (size_t begin; (begin = next.fetch_add(CHUNK)) < batch.size(); )
+		{
+			for (size_t i = begin; i < min(begin + CHUNK, batch.size()); ++i)
+			{
+				ret[i] = hmm.viterbiPass(batch[i], delta, backptr);
+				ret[i].first = exp(ret[i].first);
+				meter.advance(1);
+			}
+		}
+	});
+
+	meter.finish();
+	return ret;
+}
+
+
+/* Scaled forward-backward over pair states, adding the sequence's expected counts to stats.
+ * Position t of a trellis holds N*N pair values, except t = 0 which holds N single states.
+ * alpha, beta and scale are scratch buffers reused between calls. Returns the log-likelihood,
+ * or -inf if the sequence cannot be produced. */
+double SecondOrderHiddenMarkovModel::accumulate(const vector<int>& obs, Stats& stats,
+												HugePageVector<double>& alpha,
+												HugePageVector<double>& beta,
+												vector<double>& scale) const
+{
+	size_t N = _stateNames.size(), M = outputs().size(), NN = N*N, T = obs.size();
+	if (T == 0)
+		return 0;
+
+	alpha.assign(T*NN, 0.0);
+	beta.assign(T*NN, 0.0);
+	scale.resize(T);
+	double logLikelihood = 0;
+
+	for (size_t t = 0; t < T; ++t)
+	{
+		double* cur = &alpha[t*NN];
+		size_t width = (t == 0) ? N : NN;
+
+		if (t == 0)
+		{
+			for (size_t i = 0; i < N; ++i)
+				cur[i] = _pi[i] * _b[i*M + obs[0]];
+		}
+		else if (t == 1)
+		{
+			for (size_t i = 0; i < N; ++i)
+				for (size_t j = 0; j < N; ++j)
+					cur[i*N + j] = alpha[i] * _a1[i*N + j] * _b[j*M + obs[1]];
+		}
+		else
+		{
+			const double* prev = &alpha[(t-1)*NN];
+			for (size_t i = 0; i < N; ++i)
+			{
+				for (size_t j = 0; j < N; ++j)
+				{
+					double p = prev[i*N + j];
+					if (p == 0)
+						continue;
+
+					const double* row = &_a2[(i*N + j)*N];
+					for (size_t k = 0; k < N; ++k)
+						cur[j*N + k] += p * row[k];
+				}
+			}
+			for (size_t j = 0; j < N; ++j)
+				for (size_t k = 0; k < N; ++k)
+					cur[j*N + k] *= _b[k*M + obs[t]];
+		}
+
+		scale[t] = 0;
+		for (size_t p = 0; p < width; ++p)
+			scale[t] += cur[p];
+		if (scale[t] == 0)
+			return -numeric_limits<double>::infinity();
+
+		for (size_t p = 0; p < width; ++p)
+			cur[p] /= scale[t];
+		logLikelihood += log(scale[t]);
+	}
+
+	fill(&beta[(T-1)*NN], &beta[(T-1)*NN] + ((T == 1) ? N : NN), 1.0);
+	for (size_t t = T-1; t >= 2; --t)
+	{
+		const double* next = &beta[t*NN];
+		double* cur = &beta[(t-1)*NN];
+
+		for (size_t i = 0; i < N; ++i)
+		{
+			for (size_t j = 0; j < N; ++j)
+			{
+				const double* row = &_a2[(i*N + j)*N];
+				double sum = 0;
+				for (size_t k = 0; k < N; ++k)
+					sum += row[k] * _b[k*M + obs[t]] * next[j*N + k];
+				cur[i*N + j] = sum / scale[t];
+			}
+		}
+	}
+	if (T > 1)
+	{
+		for (size_t i = 0; i < N; ++i)
+		{
+			double sum = 0;
+			for (size_t j = 0; j < N; ++j)
+				sum += _a1[i*N + j] * _b[j*M + obs[1]] * beta[NN + i*N + j];
+			beta[i] = sum / scale[1];
+		}
+	}
+
+	/* State posteriors give the initial state and emission counts. */
+	for (size_t i = 0; i < N; ++i)
+	{
+		double gamma = alpha[i] * beta[i];
+		stats.initial[i] += gamma;
+		stats.emissions[i*M + obs[0]] += gamma;
+	}
+	for (size_t t = 1; t < T; ++t)
+		for (size_t j = 0; j < N; ++j)
+			for (size_t k = 0; k < N; ++k)
+				stats.emissions[k*M + obs[t]] += alpha[t*NN + j*N + k] * beta[t*NN + j*N + k];
+
+	/* Expected first transition, then expected second-order transitions. */
+	if (T > 1)
+	{
+		for (size_t i = 0; i < N; ++i)
+			for (size_t j = 0; j < N; ++j)
+				stats.first[i*N + j] += alpha[i] * _a1[i*N + j] * _b[j*M + obs[1]] *
+										beta[NN + i*N + j] / scale[1];
+	}
+	for (size_t t = 2; t < T; ++t)
+	{
+		const double* prev = &alpha[(t-1)*NN];
+		const double* next = &beta[t*NN];
+
+		for (size_t i = 0; i < N; ++i)
+		{
+			for (size_t j = 0; j < N; ++j)
+			{
+				double weight = prev[i*N + j] / scale[t];
+				if (weight == 0)
+					continue;
+
+				const double* row = &_a2[(i*N + j)*N];
+				double* counts = &stats.second[(i*N + j)*N];
+				for (size_t k = 0; k < N; ++k)
+					counts[k] += weight * row[k] * _b[k*M + obs[t]] * next[j*N + k];
+			}
+		}
+	}
+
+	stats.logLikelihood += logLikelihood;
+	++stats.sequences;
+	return logLikelihood;
+}
+
+
+/* Normalizes each row of counts into params; rows without counts become zero. */
+static void normalizeRows(const vector<double>& counts, HugePageVector<double>& params,
+						  size_t cols)
+{
+	for (size_t r = 0; r < counts.size() / cols; ++r)
+	{
+		double sum = 0;
+		for (size_t c = 0; c < cols; ++c)
+			sum += counts[r*cols + c];
+		for (size_t c = 0; c < cols; ++c)
+			params[r*cols + c] = (sum == 0.0) ? 0.0 : counts[r*cols + c] / sum;
+	}
+}
+
+double SecondOrderHiddenMarkovModel::train(const vector<vector<int> >& corpus,
+										   const TrainingOptions& options)
+{
+	size_t N = _stateNames.size(), M = outputs().size();
+	double logLikelihood = -numeric_limits<double>::infinity();
+	if (options.validation)
+		throw runtime_error("validation needs a first-order model");
+
+	vector<HugePageVector<double> > alpha(options.execution.workers());
+	vector<HugePageVector<double> > beta(options.execution.workers());
+	vector<vector<double> > scale(options.execution.workers());
+
+	for (size_t iteration = 1; iteration <= options.iterations; ++iteration)
+	{
+		if (options.execution.cancelled())
+			throw Cancelled();
+
+		Stats stats = reduceItems<Stats>(corpus.size(), options.execution, options.deterministic,
+										 options.shardSize, "estep2",
+										 [&] { return Stats(N, M); },
+										 [&](unsigned worker, size_t i, Stats& stats) {
+			accumulate(corpus[i], stats, alpha[worker], beta[worker], scale[worker]);
+		});
+
+		normalizeRows(stats.first, _a1, N);
+		normalizeRows(stats.second, _a2, N);
+		normalizeRows(stats.emissions, _b, M);
+		for (size_t i = 0; i < N; ++i)
+			_pi[i] = (stats.sequences == 0) ? 0.0 : stats.initial[i] / stats.sequences;
+		updateLogTables();
+
+		logLikelihood = stats.logLikelihood;
+	}
+
+	return logLikelihood;
+}
+
+
+void SecondOrderHiddenMarkovModel::save(const string& filename) const
+{
+	ofstream file(filename);
+	if (!file.is_open())
+		throw runtime_error("cannot create file: " + filename);
+
+	size_t N = _stateNames.size(), M = outputs().size();
+	file << N << " " << M << " " << _numOfTimeSteps << endl;
+
+	for (auto stt : _stateNames)
+		file << stt << " ";
+	file << endl;
+
+	for (auto out : outputs())
+		file << out << " ";
+	file << endl;
+
+	/* Writes params as rows of cols values under label. */
+	auto section = [&](const char* label, const HugePageVector<double>& params, size_t cols) {
+		file << label << endl;
+		for (size_t r = 0; r < params.size() / cols; ++r)
+		{
+			for (size_t c = 0; c < cols; ++c)
+				file << params[r*cols + c] << " ";
+			file << endl;
+		}
+	};
+
+	section("a:", _a1, N);
+	section("b:", _b, M);
+	section("pi:", _pi, N);
+	section("a2:", _a2, N);
+}
+
+
+void SecondOrderHiddenMarkovModel::optimized(const string& obsFilename, const string& optFilename,
+											 const TrainingOptions& options) const
+{
+	vector<vector<string> > observations = parseObsFile(obsFilename);
+	if (observations.empty())
+		throw runtime_error("observation file is empty");
+
+	vector<vector<int> > corpus;
+	for (auto& obs : observations)
+		corpus.push_back(intern(obs));
+
+	/* As for first-order models, a cancelled run still writes its last completed iteration. */
+	SecondOrderHiddenMarkovModel optimized(*this);
+	try
+	{
+		optimized.train(corpus, options);
+	}
+	catch (const Cancelled&)
+	{
+		optimized.save(optFilename);
+		throw;
+	}
+	optimized.save(optFilename);
+}
@@ -0,0 +1,94 @@
+#ifndef GUARD_SECONDORDERHMM_HPP
+#define GUARD_SECONDORDERHMM_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "HiddenMarkovModel.hpp"
+
+
+/*
+ * Hidden Markov model with second-order transitions P(s_t | s_t-2, s_t-1).
+ *
+ * The engines run over the expanded state space of pairs (s_t-1, s_t) without materializing
+ * its N^2 x N^2 transition matrix: pair (i, j) can only move to the N pairs (j, k), so a time
+ * step costs O(N^3) instead of O(N^4), and pairs with zero probability are skipped altogether.
+ *
+ * The .hmm format is extended with an "a2:" section after "pi:" holding the transition tensor
+ * as N*N rows of N values, where row i*N + j is P(. | s_t-2 = i, s_t-1 = j). The "a:" matrix
+ * gives the first transition, from s_0 to s_1.
+ */
+class SecondOrderHiddenMarkovModel
+{
+public:
+	SecondOrderHiddenMarkovModel(const std::string& filename);
+
+	/** Returns whether an .hmm file holds a second-order model. */
+	static bool isSecondOrder(const std::string& filename);
+
+	const std::vector<std::string>& states() const { return _stateNames; }
+	const std::vector<std::string>& outputs() const { return _vocabulary->names; }
+
+	std::vector<int> intern(const std::vector<std::string>& obs) const;
+
+	/**
+	 * Returns the probability of each observation sequence in a given .obs file.
+	 */
+	std::vector<double> forward(const std::string& filename,
+								const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	std::vector<double> forward(const std::vector<std::vector<int> >& batch,
+								const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	/**
+	 * Returns the most likely state sequence probability and its state path for each
+	 * observation sequence in a given .obs file.
+	 */
+	std::vector<std::pair<double, std::vector<std::string> > >
+		viterbi(const std::string& filename,
+				const ExecutionPolicy& policy = ExecutionPolicy()) const;
+	std::vector<std::pair<double, std::vector<int> > >
+		viterbi(const std::vector<std::vector<int> >& batch,
+				const ExecutionPolicy& policy = ExecutionPolicy()) const;
+
+	/**
+	 * Runs Baum-Welch iterations over a corpus in place and returns the log-likelihood of the
+	 * corpus before the last re-estimation. Statistics are combined as for first-order
+	 * models, following options.deterministic.
+	 */
+	double train(const std::vector<std::vector<int> >& corpus,
+				 const TrainingOptions& options = TrainingOptions());
+	/**
+	 * Writes the model to an .hmm file.
+	 */
+	void save(const std::string& filename) const;
+	/**
+	 * Writes an optimized model with respect to the observation sequences in an .obs file.
+	 */
+	void optimized(const std::string& obsFilename, const std::string& optFilename,
+				   const TrainingOptions& options = TrainingOptions()) const;
+
+private:
+	struct Stats;
+
+	double forwardPass(const std::vector<int>&, HugePageVector<double>&) const;
+	std::pair<double, std::vector<int> > viterbiPass(const std::vector<int>&,
+													 HugePageVector<double>&,
+													 HugePageVector<int>&) const;
+	double accumulate(const std::vector<int>&, Stats&, HugePageVector<double>&,
+					  HugePageVector<double>&, std::vector<double>&) const;
+	void updateLogTables();
+
+private:
+	size_t _numOfTimeSteps;
+	std::vector<std::string> _stateNames;
+	std::shared_ptr<const Vocabulary> _vocabulary;
+
+	/* Dense row-major parameters: pi[i], a1[i*N + j], a2[(i*N + j)*N + k], b[i*M + o]. */
+	HugePageVector<double> _pi, _a1, _a2, _b;
+	/* Their logarithms, for the Viterbi engine. */
+	HugePageVector<double> _logPi, _logA1, _logA2, _logB;
+	/* Per-NUMA-node copies for engines run with replication, cleared by updateLogTables(). */
+	mutable ReplicaCache<SecondOrderHiddenMarkovModel> _replicas;
+};
+
+
+#endif
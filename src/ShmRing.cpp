@@ -0,0 +1,337 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include "ShmRing.hpp"
+
+using namespace std;
+
+
+static const uint32_t RING_MAGIC = 0x484d4d52; // "HMMR"
+static const size_t HEADER_SIZE = 512;
+
+/* Indices are monotonically increasing counters; the slot is index % capacity. Each counter
+ * lives on its own cache line so the two sides never write to the same line. */
+struct ShmRing::Header
+{
+	uint32_t magic;
+	uint32_t capacity;
+	uint32_t maxLength;
+	uint32_t slotSize;
+	atomic<uint32_t> stop;
+
+	alignas(64) atomic<uint64_t> submitHead;	// consumed by the server
+	alignas(64) atomic<uint64_t> submitTail;	// produced by the client
+	alignas(64) atomic<uint64_t> completeHead;	// consumed by the client
+	alignas(64) atomic<uint64_t> completeTail;	// produced by the server
+};
+
+
+static size_t slotSize(uint32_t maxLength)
+{
+	size_t size = sizeof(ShmRing::Entry) + maxLength * sizeof(int32_t);
+	return (size + 63) & ~size_t(63);
+}
+
+static size_t mappingSize(uint32_t capacity, uint32_t maxLength)
+{
+	return HEADER_SIZE + 2 * size_t(capacity) * slotSize(maxLength);
+}
+
+
+ShmRing ShmRing::create(const string& name, uint32_t capacity, uint32_t maxLength)
+{
+	static_assert(sizeof(Header) <= HEADER_SIZE, "ring header does not fit its reserved space");
+
+	if (capacity == 0 || maxLength == 0)
+		throw runtime_error("ring capacity and maximum length must be positive");
+
+	/* An existing ring may still be served or attached to, so it is never replaced. */
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
+		throw runtime_error("cannot create shared memory ring " + name + ": " + strerror(errno));
+
+	size_t size = mappingSize(capacity, maxLength);
+	if (ftruncate(fd, size) != 0)
+	{
+		close(fd);
+		shm_unlink(name.c_str());
+		throw runtime_error("cannot size shared memory ring " + name + ": " + strerror(errno));
+	}
+
+	void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		shm_unlink(name.c_str());
+		throw runtime_error("cannot map shared memory ring " + name + ": " + strerror(errno));
+	}
+
+	Header* header = new (base) Header;
+	header->capacity = capacity;
+	header->maxLength = maxLength;
+	header->slotSize = slotSize(maxLength);
+	header->stop.store(0);
+	header->submitHead.store(0);
+	header->submitTail.store(0);
+	header->completeHead.store(0);
+	header->completeTail.store(0);
+	atomic_thread_fence(memory_order_release);
+	header->magic = RING_MAGIC;
+
+	return ShmRing(name, base, size, true);
+}
+
+
+ShmRing ShmRing::attach(const string& name)
+{
+	int fd = shm_open(name.c_str(), O_RDWR, 0);
+	if (fd < 0)
+		throw runtime_error("cannot open shared memory ring " + name + ": " + strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header))
+	{
+		close(fd);
+		throw runtime_error("not a shared memory ring: " + name);
+	}
+
+	void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		throw runtime_error("cannot map shared memory ring " + name + ": " + strerror(errno));
+
+	const Header* header = static_cast<const Header*>(base);
+	if (header->magic != RING_MAGIC ||
+		size_t(st.st_size) != mappingSize(header->capacity, header->maxLength))
+	{
+		munmap(base, st.st_size);
+		throw runtime_error("not a shared memory ring: " + name);
+	}
+
+	return ShmRing(name, base, st.st_size, false);
+}
+
+
+ShmRing::ShmRing(const string& name, void* base, size_t size, bool owner)
+	: _name(name), _base(base), _size(size), _owner(owner),
+	  _header(static_cast<Header*>(base)), _capacity(_header->capacity),
+	  _maxLength(_header->maxLength), _slotSize(_header->slotSize)
+{
+}
+
+
+ShmRing::ShmRing(ShmRing&& other)
+	: _name(other._name), _base(other._base), _size(other._size), _owner(other._owner),
+	  _header(other._header), _capacity(other._capacity), _maxLength(other._maxLength),
+	  _slotSize(other._slotSize)
+{
+	other._base = NULL;
+	other._owner = false;
+}
+
+
+ShmRing::~ShmRing()
+{
+	if (_base)
+		munmap(_base, _size);
+	if (_owner)
+		shm_unlink(_name.c_str());
+}
+
+
+uint32_t ShmRing::capacity() const
+{
+	return _capacity;
+}
+
+
+uint32_t ShmRing::maxLength() const
+{
+	return _maxLength;
+}
+
+
+void ShmRing::requestStop()
+{
+	_header->stop.store(1, memory_order_release);
+}
+
+
+bool ShmRing::stopRequested() const
+{
+	return _header->stop.load(memory_order_acquire) != 0;
+}
+
+
+ShmRing::Entry* ShmRing::slot(size_t ring, uint64_t index) const
+{
+	size_t pos = (ring * _capacity + index % _capacity) * _slotSize;
+	return reinterpret_cast<Entry*>(static_cast<char*>(_base) + HEADER_SIZE + pos);
+}
+
+
+bool ShmRing::trySubmit(uint64_t tag, Query query, const int32_t* symbols, uint32_t length)
+{
+	uint64_t tail = _header->submitTail.load(memory_order_relaxed);
+	if (tail - _header->submitHead.load(memory_order_acquire) == _capacity)
+		return false;
+	if (length > _maxLength)
+		throw runtime_error("sequence is longer than the ring's maximum length");
+
+	Entry* entry = slot(0, tail);
+	entry->tag = tag;
+	entry->query = query;
+	entry->status = Ok;
+	entry->length = length;
+	entry->score = 0;
+	memcpy(entry->data(), symbols, length * sizeof(int32_t));
+
+	_header->submitTail.store(tail + 1, memory_order_release);
+	return true;
+}
+
+
+bool ShmRing::tryComplete(Entry& result, vector<int32_t>& path)
+{
+	uint64_t head = _header->completeHead.load(memory_order_relaxed);
+	if (head == _header->completeTail.load(memory_order_acquire))
+		return false;
+
+	const Entry* entry = slot(1, head);
+	result = *entry;
+	path.assign(entry->data(), entry->data() + entry->length);
+
+	_header->completeHead.store(head + 1, memory_order_release);
+	return true;
+}
+
+
+const ShmRing::Entry* ShmRing::peekSubmission(uint64_t offset)
+{
+	uint64_t head = _header->submitHead.load(memory_order_relaxed) + offset;
+	if (head >= _header->submitTail.load(memory_order_acquire))
+		return NULL;
+
+	return slot(0, head);
+}
+
+
+void ShmRing::popSubmissions(uint64_t count)
+{
+	_header->submitHead.fetch_add(count, memory_order_release);
+}
+
+
+ShmRing::Entry* ShmRing::reserveCompletion()
+{
+	uint64_t tail = _header->completeTail.load(memory_order_relaxed);
+	if (tail - _header->completeHead.load(memory_order_acquire) == _capacity)
+		return NULL;
+
+	return slot(1, tail);
+}
+
+
+void ShmRing::pushCompletion()
+{
+	_header->completeTail.fetch_add(1, memory_order_release);
+}
+
+
+void serve(ShmRing& ring, const HiddenMarkovModel& hmm)
+{
+	const int32_t outputs = hmm.outputs().size();
+	unsigned idle = 0;
+
+	while (!ring.stopRequested() || ring.peekSubmission())
+	{
+		/* Gather the burst of submissions that is already queued. */
+		vector<const ShmRing::Entry*> burst;
+		while (const ShmRing::Entry* entry = ring.peekSubmission(burst.size()))
+			burst.push_back(entry);
+
+		if (burst.empty())
+		{
+			/* Back off gently while the clients are quiet; the clients never wait on us. */
+			if (++idle < 1024)
+				sched_yield();
+			else
+				usleep(50);
+			continue;
+		}
+		idle = 0;
+
+		vector<uint32_t> status(burst.size(), ShmRing::Ok);
+		vector<vector<int> > likelihood, statepath;
+		vector<size_t> likelihoodAt, statepathAt;
+
+		for (size_t i = 0; i < burst.size(); ++i)
+		{
+			/* The slot is shared with the client, so its length is read once and checked
+			 * before anything past the slot header is touched. */
+			const ShmRing::Entry* entry = burst[i];
+			uint32_t length = entry->length;
+			if (length > ring.maxLength())
+			{
+				status[i] = ShmRing::BadLength;
+				continue;
+			}
+			vector<int> obs(entry->data(), entry->data() + length);
+
+			for (auto out : obs)
+				if (out < 0 || out >= outputs)
+					status[i] = ShmRing::BadSymbol;
+			if (status[i] != ShmRing::Ok)
+				continue;
+
+			if (entry->query == ShmRing::StatePath)
+			{
+				statepath.push_back(obs);
+				statepathAt.push_back(i);
+			}
+			else
+			{
+				likelihood.push_back(obs);
+				likelihoodAt.push_back(i);
+			}
+		}
+
+		vector<double> scores(burst.size(), 0);
+		vector<vector<int> > paths(burst.size());
+
+		vector<double> probs = hmm.forward(likelihood);
+		for (size_t i = 0; i < probs.size(); ++i)
+			scores[likelihoodAt[i]] = probs[i];
+
+		vector<pair<double, vector<int> > > best = hmm.viterbi(statepath);
+		for (size_t i = 0; i < best.size(); ++i)
+		{
+			scores[statepathAt[i]] = best[i].first;
+			paths[statepathAt[i]].swap(best[i].second);
+		}
+
+		/* Publish completions in submission order, waiting for the client to make room. */
+		for (size_t i = 0; i < burst.size(); ++i)
+		{
+			ShmRing::Entry* done;
+			while (!(done = ring.reserveCompletion()))
+				sched_yield();
+
+			done->tag = burst[i]->tag;
+			done->query = burst[i]->query;
+			done->status = status[i];
+			done->length = paths[i].size();
+			done->score = scores[i];
+			copy(paths[i].begin(), paths[i].end(), done->data());
+			ring.pushCompletion();
+		}
+
+		ring.popSubmissions(burst.size());
+	}
+}
@@ -0,0 +1,98 @@
+#ifndef GUARD_SHMRING_HPP
+#define GUARD_SHMRING_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "HiddenMarkovModel.hpp"
+
+
+/*
+ * A POSIX shared-memory request ring for co-located clients. The mapping holds two
+ * single-producer/single-consumer rings of fixed-size slots: the client pushes interned
+ * observation sequences onto the submission ring and pops scores and state paths from the
+ * completion ring. Both sides only touch atomics and the mapped slots on the fast path.
+ *
+ * The server creates the ring and a client attaches to it by name. Because both rings have a
+ * single producer and a single consumer, a ring serves one client at a time; concurrent
+ * clients each need a ring, and so a server, of their own.
+ */
+class ShmRing
+{
+public:
+	enum Query { Likelihood = 0, StatePath = 1 };
+	enum Status { Ok = 0, BadSymbol = 1, BadLength = 2 };
+
+	/* Slot header; the slot's symbol or state IDs follow it in the mapping. */
+	struct Entry
+	{
+		uint64_t tag;
+		uint32_t query;
+		uint32_t status;
+		uint32_t length;
+		uint32_t reserved;
+		double score;
+
+		int32_t* data() { return reinterpret_cast<int32_t*>(this + 1); }
+		const int32_t* data() const { return reinterpret_cast<const int32_t*>(this + 1); }
+	};
+
+	/**
+	 * Creates the named ring with room for capacity sequences of maxLength. Throws if a ring
+	 * of that name already exists.
+	 */
+	static ShmRing create(const std::string& name, uint32_t capacity, uint32_t maxLength);
+	/** Attaches to a ring created by a server. */
+	static ShmRing attach(const std::string& name);
+
+	ShmRing(ShmRing&& other);
+	~ShmRing();
+
+	uint32_t capacity() const;
+	uint32_t maxLength() const;
+
+	/** Asks the server to stop once the submissions queued so far are served. */
+	void requestStop();
+	bool stopRequested() const;
+
+	/* Client side. Both return false instead of blocking when the ring is full or empty;
+	 * submitting a sequence longer than maxLength() throws. */
+	bool trySubmit(uint64_t tag, Query query, const int32_t* symbols, uint32_t length);
+	bool tryComplete(Entry& result, std::vector<int32_t>& path);
+
+	/* Server side. The returned slots stay valid until the matching pop or push. */
+	const Entry* peekSubmission(uint64_t offset = 0);
+	void popSubmissions(uint64_t count);
+	Entry* reserveCompletion();
+	void pushCompletion();
+
+private:
+	struct Header;
+
+	ShmRing(const std::string& name, void* base, size_t size, bool owner);
+	ShmRing(const ShmRing&);
+	ShmRing& operator=(const ShmRing&);
+
+	Entry* slot(size_t ring, uint64_t index) const;
+
+private:
+	std::string _name;
+	void* _base;
+	size_t _size;
+	bool _owner;
+	Header* _header;
+	/* Private copies of the layout, which the other side of the mapping could overwrite. */
+	uint32_t _capacity, _maxLength;
+	size_t _slotSize;
+};
+
+
+/**
+ * Serves submissions from the ring against hmm until a stop is requested, draining each
+ * burst of queued submissions through the batched forward and Viterbi engines.
+ */
+void serve(ShmRing& ring, const HiddenMarkovModel& hmm);
+
+
+#endif
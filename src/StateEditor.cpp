@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include "StateEditor.hpp"
+
+using namespace std;
+
+
+/* Where the counts of each old state go: a list of (new state, share) per old state. */
+typedef vector<vector<pair<size_t, double> > > StateMap;
+
+/* The sequences that visit the edited states least keep their cached counts, as long as
+ * together they account for at most this share of the states' expected visits. */
+static const double UNAFFECTED_SHARE = 1e-3;
+
+
+/* State s becomes states s and N, each with half of its counts. */
+static StateMap splitMap(size_t N, size_t s)
+{
+	StateMap to(N);
+	for (size_t i = 0; i < N; ++i)
+		to[i].push_back(make_pair(i, 1.0));
+
+	to[s][0].second = 0.5;
+	to[s].push_back(make_pair(N, 0.5));
+	return to;
+}
+
+
+/* State j is pooled into state i and the states after j move down by one. */
+static StateMap mergeMap(size_t N, size_t i, size_t j)
+{
+	StateMap to(N);
+	for (size_t k = 0; k < N; ++k)
+		to[k].push_back(make_pair(k < j ? k : k - 1, 1.0));
+
+	to[j][0].first = (i < j) ? i : i - 1;
+	return to;
+}
+
+
+/* Moves the counts of N states over to newN states. Transition counts are shared by both of
+ * their ends. */
+static BaumWelchStats remap(const BaumWelchStats& stats, size_t N, size_t M, const StateMap& to,
+							size_t newN)
+{
+	BaumWelchStats ret(newN, M);
+	ret.logLikelihood = stats.logLikelihood;
+	ret.sequences = stats.sequences;
+
+	for (size_t i = 0; i < N; ++i)
+	{
+		for (const auto& from : to[i])
+		{
+			for (size_t j = 0; j < N; ++j)
+				for (const auto& dest : to[j])
+					ret.transitions[from.first*newN + dest.first] +=
+						stats.transitions[i*N + j] * from.second * dest.second;
+			for (size_t k = 0; k < M; ++k)
+				ret.emissions[from.first*M + k] += stats.emissions[i*M + k] * from.second;
+			ret.initial[from.first] += stats.initial[i] * from.second;
+		}
+	}
+	return ret;
+}
+
+
+/* Takes other's counts out of stats. Counts are clamped at zero against rounding. */
+static void subtract(BaumWelchStats& stats, const BaumWelchStats& other)
+{
+	for (size_t i = 0; i < stats.transitions.size(); ++i)
+		stats.transitions[i] = max(0.0, stats.transitions[i] - other.transitions[i]);
+	for (size_t i = 0; i < stats.emissions.size(); ++i)
+		stats.emissions[i] = max(0.0, stats.emissions[i] - other.emissions[i]);
+	for (size_t i = 0; i < stats.initial.size(); ++i)
+		stats.initial[i] = max(0.0, stats.initial[i] - other.initial[i]);
+
+	stats.logLikelihood -= other.logLikelihood;
+	stats.sequences -= other.sequences;
+}
+
+
+StateEditor::StateEditor(HiddenMarkovModel& model, const vector<vector<int> >& corpus,
+						 const TrainingOptions& options, size_t localIterations)
+	: _model(model), _corpus(corpus), _options(options), _localIterations(localIterations)
+{
+	vector<size_t> all(corpus.size());
+	iota(all.begin(), all.end(), 0);
+
+	_sequenceStats.resize(corpus.size());
+	_stats = gather(all);
+}
+
+
+size_t StateEditor::split(size_t state, unsigned long seed)
+{
+	size_t N = _model.states().size(), M = _model.outputs().size();
+	if (state >= N)
+		throw runtime_error("no such state: " + to_string(state));
+
+	/* The new state starts from the same counts as the old one, with its rows perturbed. */
+	StateMap to = splitMap(N, state);
+	BaumWelchStats params = remap(_stats, N, M, to, N + 1);
+	mt19937_64 rng(seed);
+	uniform_real_distribution<double> jitter(0.5, 1.5);
+	for (size_t j = 0; j <= N; ++j)
+		params.transitions[N*(N + 1) + j] *= jitter(rng);
+	for (size_t k = 0; k < M; ++k)
+		params.emissions[N*M + k] *= jitter(rng);
+
+	vector<string> names = _model.states();
+	string name = names[state] + "'";
+	while (find(names.begin(), names.end(), name) != names.end())
+		name += "'";
+	names.push_back(name);
+
+	edit(visitors(vector<size_t>(1, state)), to, params, names);
+	return N;
+}
+
+
+void StateEditor::merge(size_t i, size_t j)
+{
+	size_t N = _model.states().size(), M = _model.outputs().size();
+	if (i >= N || j >= N || i == j)
+		throw runtime_error("cannot merge states " + to_string(i) + " and " + to_string(j));
+
+	/* Pooled counts give the merged state the occupancy-weighted mean of both rows. */
+	StateMap to = mergeMap(N, i, j);
+	BaumWelchStats params = remap(_stats, N, M, to, N - 1);
+
+	vector<string> names = _model.states();
+	names.erase(names.begin() + j);
+
+	vector<size_t> states;
+	states.push_back(i);
+	states.push_back(j);
+	edit(visitors(states), to, params, names);
+}
+
+
+double StateEditor::train()
+{
+	vector<size_t> all(_corpus.size());
+	iota(all.begin(), all.end(), 0);
+
+	for (size_t iteration = 1; iteration <= _options.iterations; ++iteration)
+	{
+		if (_options.execution.cancelled())
+			throw Cancelled();
+
+		_model.maximize(_stats);
+		_stats = gather(all);
+	}
+	return _stats.logLikelihood;
+}
+
+
+size_t StateEditor::busiest() const
+{
+	size_t N = _model.states().size(), M = _model.outputs().size();
+	size_t best = 0;
+	double bestVisits = -1;
+
+	/* A state's expected emissions are its expected visits. */
+	for (size_t i = 0; i < N; ++i)
+	{
+		double visits = accumulate(_stats.emissions.begin() + i*M,
+								   _stats.emissions.begin() + (i + 1)*M, 0.0);
+		if (visits > bestVisits)
+		{
+			best = i;
+			bestVisits = visits;
+		}
+	}
+	return best;
+}
+
+
+/* Returns, in corpus order, the sequences that visit the given states most, leaving out the
+ * least visiting ones up to UNAFFECTED_SHARE of the states' expected visits. A sequence's
+ * expected emissions from a state are its expected visits to it. */
+vector<size_t> StateEditor::visitors(const vector<size_t>& states) const
+{
+	size_t M = _model.outputs().size();
+	vector<pair<double, size_t> > visits;
+	double total = 0;
+
+	for (size_t s = 0; s < _corpus.size(); ++s)
+	{
+		const vector<double>& emissions = _sequenceStats[s].emissions;
+		double v = 0;
+		for (auto i : states)
+			v = accumulate(emissions.begin() + i*M, emissions.begin() + (i + 1)*M, v);
+		if (v > 0)
+			visits.push_back(make_pair(v, s));
+		total += v;
+	}
+
+	sort(visits.begin(), visits.end());
+	double left = 0;
+	size_t skip = 0;
+	while (skip < visits.size() && left + visits[skip].first <= UNAFFECTED_SHARE * total)
+		left += visits[skip++].first;
+
+	vector<size_t> ret;
+	for (size_t k = skip; k < visits.size(); ++k)
+		ret.push_back(visits[k].second);
+	sort(ret.begin(), ret.end());
+	return ret;
+}
+
+
+/* Runs the E-step over the given sequences under the current parameters, rewriting their
+ * cached statistics, and returns the sum of those. */
+BaumWelchStats StateEditor::gather(const vector<size_t>& items)
+{
+	const HiddenMarkovModel& hmm = _model;
+	size_t N = hmm.states().size(), M = hmm.outputs().size();
+	vector<HugePageVector<double> > alpha(_options.execution.workers());
+	vector<HugePageVector<double> > beta(_options.execution.workers());
+	vector<vector<double> > scale(_options.execution.workers());
+	vector<vector<double> > weighted(_options.execution.workers());
+
+	/* Each sequence owns its cached statistics, so workers can fill them in directly. */
+	auto add = [&](unsigned worker, size_t k, BaumWelchStats& stats) {
+		BaumWelchStats& own = _sequenceStats[items[k]];
+		own = BaumWelchStats(N, M);
+		if (hmm.accumulate(_corpus[items[k]], own, alpha[worker], beta[worker], scale[worker],
+						   weighted[worker]) == -numeric_limits<double>::infinity())
+			return;
+
+		/* accumulate() leaves the transition probabilities out of the expected transitions. */
+		for (size_t i = 0; i < N*N; ++i)
+			own.transitions[i] *= hmm._a[i];
+		stats.merge(own);
+	};
+	return reduceItems<BaumWelchStats>(items.size(), _options.execution, _options.deterministic,
+		_options.shardSize, "edit", [&] { return BaumWelchStats(N, M); }, add);
+}
+
+
+/* Replaces the model's states by names, with parameters re-estimated from params, and then
+ * runs the local EM iterations over the affected sequences. The rest of the corpus keeps its
+ * cached counts, moved over to the new states by to.
+ *
+ * If the edit itself fails or is cancelled, the model and the cache are left as they were.
+ * Once it is done the cache is kept up to date after every local iteration, so cancelling
+ * those leaves the edited model with the counts its parameters were last estimated from. */
+void StateEditor::edit(const vector<size_t>& affected, const StateMap& to,
+					   const BaumWelchStats& params, const vector<string>& names)
+{
+	size_t N = _model.states().size(), M = _model.outputs().size();
+	size_t newN = names.size();
+
+	HiddenMarkovModel original = _model;
+	BaumWelchStats base = _stats, local;
+	vector<BaumWelchStats> sequenceStats;
+	bool remapped = false;
+	try
+	{
+		for (auto s : affected)
+			subtract(base, _sequenceStats[s]);
+		base = remap(base, N, M, to, newN);
+
+		sequenceStats.reserve(_sequenceStats.size());
+		for (const auto& stats : _sequenceStats)
+			sequenceStats.push_back(remap(stats, N, M, to, newN));
+		_sequenceStats.swap(sequenceStats);
+		remapped = true;
+
+		_model._stateNames = names;
+		_model._a.resize(newN*newN);
+		_model._b.resize(newN*M);
+		_model._pi.resize(newN);
+		_model._transitions.clear();
+		_model._emissions.clear();
+		_model._initStates.clear();
+		_model.maximize(params);
+
+		local = gather(affected);
+	}
+	catch (...)
+	{
+		_model = original;
+		if (remapped)
+			_sequenceStats.swap(sequenceStats);
+		throw;
+	}
+
+	_affected = affected;
+	_stats = base;
+	_stats.merge(local);
+
+	for (size_t iteration = 1; iteration <= _localIterations; ++iteration)
+	{
+		if (_options.execution.cancelled())
+			throw Cancelled();
+
+		_model.maximize(_stats);
+		local = gather(affected);
+		_stats = base;
+		_stats.merge(local);
+	}
+}
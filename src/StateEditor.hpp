@@ -0,0 +1,77 @@
+#ifndef GUARD_STATEEDITOR_HPP
+#define GUARD_STATEEDITOR_HPP
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "HiddenMarkovModel.hpp"
+
+
+/*
+ * Grows or shrinks a model one state at a time while it is being trained, without retraining
+ * from scratch. The editor keeps the Baum-Welch statistics of the whole corpus and of each
+ * sequence, N*N + N*M + N counts apiece. A split or merge only touches the sequences that
+ * account for most visits to the edited states: their cached counts are taken out of the
+ * corpus statistics, and a few local EM iterations re-run the E-step over just those
+ * sequences while the rest of the corpus keeps its cached counts.
+ *
+ * This is the incremental EM of Neal and Hinton (1998), restricted to the affected
+ * sequences. The untouched counts go stale as the parameters move, so train() should run now
+ * and then to refresh them.
+ */
+class StateEditor
+{
+public:
+	/**
+	 * Edits model in place, training it on corpus, which is interned with the model's
+	 * vocabulary and must outlive the editor. Runs one E-step over the corpus to fill the
+	 * cache.
+	 */
+	StateEditor(HiddenMarkovModel& model, const std::vector<std::vector<int> >& corpus,
+				const TrainingOptions& options = TrainingOptions(), size_t localIterations = 3);
+
+	/**
+	 * Splits a state in two: the new state, appended last, takes half of the state's counts,
+	 * with its rows randomly perturbed from a generator seeded with seed so that the two
+	 * can drift apart. Returns the index of the new state.
+	 */
+	size_t split(size_t state, unsigned long seed = 0);
+	/**
+	 * Merges state j into state i, pooling their counts; j is removed and the states after
+	 * it move down by one.
+	 */
+	void merge(size_t i, size_t j);
+	/**
+	 * Runs options.iterations full Baum-Welch iterations, which also refresh the cache, and
+	 * returns the corpus log-likelihood under the final parameters.
+	 */
+	double train();
+
+	/** Returns the state with the highest expected number of visits over the corpus. */
+	size_t busiest() const;
+	/** Returns the corpus log-likelihood according to the cache. */
+	double logLikelihood() const { return _stats.logLikelihood; }
+	/** Returns the number of sequences the last split or merge re-ran. */
+	size_t affected() const { return _affected.size(); }
+
+private:
+	std::vector<size_t> visitors(const std::vector<size_t>&) const;
+	BaumWelchStats gather(const std::vector<size_t>&);
+	void edit(const std::vector<size_t>&,
+			  const std::vector<std::vector<std::pair<size_t, double> > >&,
+			  const BaumWelchStats&, const std::vector<std::string>&);
+
+private:
+	HiddenMarkovModel& _model;
+	const std::vector<std::vector<int> >& _corpus;
+	TrainingOptions _options;
+	size_t _localIterations;
+
+	/* Statistics of the whole corpus and of each of its sequences. */
+	BaumWelchStats _stats;
+	std::vector<BaumWelchStats> _sequenceStats;
+	std::vector<size_t> _affected;
+};
+
+
+#endif
@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include "StateSweep.hpp"
+
+using namespace std;
+
+
+StateSweep::StateSweep(const HiddenMarkovModel& model, const SweepOptions& options)
+	: _options(options)
+{
+	if (options.minStates == 0 || options.minStates > options.maxStates)
+		throw runtime_error("empty range of numbers of states");
+	if (!(options.heldOutFraction > 0 && options.heldOutFraction < 1))
+		throw runtime_error("held-out fraction must be between 0 and 1");
+
+	for (size_t n = options.minStates; n <= options.maxStates; ++n)
+	{
+		_models.push_back(HiddenMarkovModel::random(n, model.vocabulary(), model.timeSteps(),
+													options.seed + n));
+
+		SweepCandidate candidate;
+		candidate.states = n;
+		candidate.iterations = 0;
+		candidate.logLikelihood = candidate.heldOutLogLikelihood =
+			-numeric_limits<double>::infinity();
+		candidate.bic = numeric_limits<double>::infinity();
+		candidate.stopped = false;
+		_candidates.push_back(candidate);
+	}
+}
+
+
+/* Ranks candidates by held-out log-likelihood, ties going to the lower BIC. */
+static bool better(const SweepCandidate& a, const SweepCandidate& b)
+{
+	if (a.heldOutLogLikelihood != b.heldOutLogLikelihood)
+		return a.heldOutLogLikelihood > b.heldOutLogLikelihood;
+	return a.bic < b.bic;
+}
+
+
+void StateSweep::run(const vector<vector<int> >& corpus)
+{
+	/* Every stride-th sequence is held out, so the split does not depend on the seed. The
+	 * split is kept as lists of indices into the corpus, which is not copied. */
+	size_t stride = max<size_t>(2, lround(1 / _options.heldOutFraction));
+	vector<size_t> training, heldOut;
+	for (size_t i = 0; i < corpus.size(); ++i)
+		(i % stride == stride - 1 ? heldOut : training).push_back(i);
+	if (training.empty() || heldOut.empty())
+		throw runtime_error("corpus is too small to hold out sequences");
+
+	double observations = 0;
+	for (auto i : training)
+		observations += corpus[i].size();
+
+	vector<size_t> alive;
+	for (size_t k = 0; k < _models.size(); ++k)
+		if (!_candidates[k].stopped)
+			alive.push_back(k);
+
+	for (size_t round = 1; round <= _options.rounds && !alive.empty(); ++round)
+	{
+		/* Candidates train side by side, each on an equal share of the workers. Within a
+		 * candidate the E-step sums over fixed shards, so that share does not change its
+		 * result. */
+		unsigned workers = _options.execution.workers();
+		ExecutionPolicy outer = _options.execution;
+		outer.threads = min<size_t>(workers, alive.size());
+		outer.progress = nullptr;
+
+		TrainingOptions inner;
+		inner.execution = _options.execution;
+		inner.execution.threads = max<size_t>(1, workers / alive.size());
+		/* The outer worker may be pinned; unpinned inner workers get the whole process mask
+		 * back instead of sharing its one CPU. */
+		inner.execution.pin = false;
+		inner.execution.progress = nullptr;
+		inner.iterations = _options.roundIterations;
+		inner.deterministic = true;
+
+		atomic<size_t> next(0);
+		runWorkers(outer, [&](unsigned) {
+			for (size_t i; (i = next.fetch_add(1)) < alive.size(); )
+			{
+				size_t k = alive[i];
+				double logLikelihood = _models[k].train(corpus, training, inner);
+				score(k, corpus, heldOut, logLikelihood, observations, inner.execution);
+			}
+		});
+
+		if (_options.execution.progress)
+		{
+			Progress progress = Progress();
+			progress.iteration = round;
+			progress.sequences = alive.size();
+			progress.totalSequences = _models.size();
+			progress.logLikelihood = _candidates[best()].heldOutLogLikelihood;
+			_options.execution.progress(progress);
+		}
+
+		if (round == _options.rounds)
+			break;
+
+		/* Keep the better half. Candidates that cannot produce a held-out sequence go first. */
+		stable_sort(alive.begin(), alive.end(), [&](size_t a, size_t b) {
+			return better(_candidates[a], _candidates[b]);
+		});
+		for (size_t i = (alive.size() + 1) / 2; i < alive.size(); ++i)
+			_candidates[alive[i]].stopped = true;
+		alive.resize((alive.size() + 1) / 2);
+	}
+}
+
+
+/* Records the scores of candidate k after a round. */
+void StateSweep::score(size_t k, const vector<vector<int> >& corpus, const vector<size_t>& heldOut,
+					   double logLikelihood, double observations, const ExecutionPolicy& policy)
+{
+	SweepCandidate& candidate = _candidates[k];
+	double N = candidate.states, M = _models[k].outputs().size();
+	double parameters = N*(N - 1) + N*(M - 1) + (N - 1);
+
+	candidate.iterations += _options.roundIterations;
+	candidate.logLikelihood = logLikelihood;
+	candidate.heldOutLogLikelihood = _models[k].logLikelihood(corpus, heldOut, policy);
+	candidate.bic = -2*logLikelihood + parameters*log(observations);
+}
+
+
+size_t StateSweep::best() const
+{
+	size_t best = _candidates.size();
+	for (size_t k = 0; k < _candidates.size(); ++k)
+	{
+		const SweepCandidate& candidate = _candidates[k];
+		if (candidate.stopped)
+			continue;
+		if (best == _candidates.size() || better(candidate, _candidates[best]))
+			best = k;
+	}
+	return best;
+}
+
+
+bool StateSweep::heldOutImpossible() const
+{
+	return _candidates[best()].heldOutLogLikelihood == -numeric_limits<double>::infinity();
+}
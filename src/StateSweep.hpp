@@ -0,0 +1,95 @@
+#ifndef GUARD_STATESWEEP_HPP
+#define GUARD_STATESWEEP_HPP
+
+#include <vector>
+#include "HiddenMarkovModel.hpp"
+
+
+/*
+ * Settings of a sweep over the number of states.
+ */
+struct SweepOptions
+{
+	SweepOptions()
+		: minStates(2), maxStates(8), heldOutFraction(0.1), rounds(6), roundIterations(5),
+		  seed(0) {}
+
+	/* Workers are shared out between the candidates still training. progress is called after
+	 * each round, with the round as iteration, the candidates still training out of all as
+	 * sequences and the best held-out log-likelihood. */
+	ExecutionPolicy execution;
+	/* Candidate numbers of states, inclusive. */
+	size_t minStates, maxStates;
+	/* Share of the corpus, every 1/heldOutFraction-th sequence, kept out of training. */
+	double heldOutFraction;
+	/* Candidates are compared after each round of roundIterations Baum-Welch iterations. */
+	size_t rounds, roundIterations;
+	/* Seeds the random starting parameters of the candidates. */
+	unsigned long seed;
+};
+
+
+/*
+ * One candidate of a sweep and its scores after its last round.
+ */
+struct SweepCandidate
+{
+	size_t states;
+	size_t iterations;
+	/* Log-likelihood of the training sequences before the last re-estimation. */
+	double logLikelihood;
+	double heldOutLogLikelihood;
+	/* Bayesian information criterion -2 logLikelihood + k log(n), for k free parameters and n
+	 * training observations; lower is better. */
+	double bic;
+	/* Dropped before the last round. */
+	bool stopped;
+};
+
+
+/*
+ * Model-order selection: trains randomly started models of every size in a range of numbers
+ * of states over one shared corpus and picks the one that best predicts held-out sequences.
+ * The candidates train concurrently, in rounds. After each round but the last the worse half
+ * of the candidates by held-out log-likelihood is stopped, so the surviving sizes get the
+ * workers for the rest of the sweep (successive halving).
+ */
+class StateSweep
+{
+public:
+	/**
+	 * Sets up the candidates, which share the output vocabulary of model.
+	 */
+	StateSweep(const HiddenMarkovModel& model, const SweepOptions& options);
+
+	/**
+	 * Runs the sweep over a corpus interned with the model's vocabulary. Throws Cancelled if
+	 * the job is cancelled; the candidates then hold their last completed round.
+	 */
+	void run(const std::vector<std::vector<int> >& corpus);
+
+	const std::vector<SweepCandidate>& candidates() const { return _candidates; }
+	const HiddenMarkovModel& model(size_t k) const { return _models[k]; }
+	/**
+	 * Returns the index of the surviving candidate with the highest held-out log-likelihood,
+	 * ties going to the lower BIC.
+	 */
+	size_t best() const;
+	/**
+	 * Tells whether even the best candidate cannot produce some held-out sequence, so that
+	 * every candidate scores -inf on them and best() falls back to BIC alone.
+	 */
+	bool heldOutImpossible() const;
+
+private:
+	void score(size_t, const std::vector<std::vector<int> >&, const std::vector<size_t>&, double,
+			   double, const ExecutionPolicy&);
+
+private:
+	SweepOptions _options;
+	std::vector<HiddenMarkovModel> _models;
+	std::vector<SweepCandidate> _candidates;
+};
+
+
+#endif
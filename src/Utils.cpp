@@ -1,6 +1,17 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
 #include <limits>
+#include <sstream>
 #include <stdexcept>
+#include <streambuf>
+#include <thread>
 #include "Utils.hpp"
 
 using namespace std;
@@ -72,6 +83,211 @@ vector<double> split(const string& line)
 }
 
 
+/* Return the decompressor for data starting with a gzip or zstd magic number, or NULL for
+ * uncompressed data. */
+static const char* decompressorFor(const char* magic, size_t length)
+{
+	const unsigned char* m = reinterpret_cast<const unsigned char*>(magic);
+
+	if (length >= 2 && m[0] == 0x1f && m[1] == 0x8b)
+		return "gzip";
+	if (length >= 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd)
+		return "zstd";
+
+	return NULL;
+}
+
+
+/* Stream buffer over the read end of a pipe. */
+class PipeBuffer : public streambuf
+{
+public:
+	PipeBuffer(int fd) : _fd(fd) { setg(_buffer, _buffer, _buffer); }
+
+protected:
+	int_type underflow()
+	{
+		ssize_t n;
+		do
+			n = read(_fd, _buffer, sizeof(_buffer));
+		while (n < 0 && errno == EINTR);
+
+		if (n <= 0)
+			return traits_type::eof();
+
+		setg(_buffer, _buffer, _buffer + n);
+		return traits_type::to_int_type(*gptr());
+	}
+
+private:
+	int _fd;
+	char _buffer[1 << 16];
+};
+
+
+/* Owns a file descriptor and closes it when it goes out of scope. */
+class FileDescriptor
+{
+public:
+	explicit FileDescriptor(int fd = -1) : _fd(fd) {}
+	~FileDescriptor() { reset(); }
+
+	int get() const { return _fd; }
+
+	/** Gives up ownership of the descriptor and returns it. */
+	int release()
+	{
+		int fd = _fd;
+		_fd = -1;
+		return fd;
+	}
+
+	void reset(int fd = -1)
+	{
+		if (_fd >= 0)
+			close(_fd);
+		_fd = fd;
+	}
+
+private:
+	FileDescriptor(const FileDescriptor&);
+	FileDescriptor& operator=(const FileDescriptor&);
+
+private:
+	int _fd;
+};
+
+
+/* Returns the absolute path of a decompressor on the search path. Relative entries are
+ * skipped, so that the working directory cannot substitute another program. */
+static string decompressorPath(const char* tool)
+{
+	const char* search = getenv("PATH");
+	istringstream dirs(search ? search : "/usr/bin:/bin");
+	for (string dir; getline(dirs, dir, ':'); )
+	{
+		if (dir.empty() || dir[0] != '/')
+			continue;
+
+		string path = dir + "/" + tool;
+		if (access(path.c_str(), X_OK) == 0)
+			return path;
+	}
+	throw runtime_error(string("decompressor not found: ") + tool);
+}
+
+
+/* Makes a pipe whose ends are not inherited by processes spawned from other threads, which
+ * would otherwise keep the pipe open and the reader from ever seeing end of file. */
+static void makePipe(FileDescriptor& read, FileDescriptor& write, const string& name)
+{
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) != 0)
+		throw runtime_error("cannot decompress " + name + ": " + strerror(errno));
+
+	read.reset(fds[0]);
+	write.reset(fds[1]);
+}
+
+
+/* Writes contents to fd and closes it. Runs on a thread of its own, and stops early if the
+ * decompressor closes its end of the pipe. */
+static void feedDecompressor(int fd, const string* contents)
+{
+	/* If the decompressor bails out early, let write() fail instead of raising SIGPIPE. */
+	sigset_t pipeSignal;
+	sigemptyset(&pipeSignal);
+	sigaddset(&pipeSignal, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipeSignal, NULL);
+
+	for (size_t done = 0; done < contents->size(); )
+	{
+		ssize_t n = write(fd, contents->data() + done, contents->size() - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	close(fd);
+}
+
+
+/* Parses the output of a decompressor process reading from input. If contents is given, it is
+ * fed to the decompressor's stdin by a separate thread; otherwise input is the compressed file
+ * itself. Decompression runs concurrently with parsing and never touches the disk. */
+static vector<vector<string> > parseDecompressed(const char* tool, const string& name,
+												 int input, const string* contents)
+{
+	string path = decompressorPath(tool);
+
+	FileDescriptor outputRead, outputWrite, feedRead, feedWrite;
+	makePipe(outputRead, outputWrite, name);
+	if (contents)
+		makePipe(feedRead, feedWrite, name);
+
+	/* dup2() clears close-on-exec on the child's stdin and stdout only. */
+	posix_spawn_file_actions_t actions;
+	if (posix_spawn_file_actions_init(&actions) != 0)
+		throw runtime_error("cannot decompress " + name + ": " + strerror(errno));
+	posix_spawn_file_actions_adddup2(&actions, contents ? feedRead.get() : input, 0);
+	posix_spawn_file_actions_adddup2(&actions, outputWrite.get(), 1);
+
+	char* argv[] = { const_cast<char*>(tool), const_cast<char*>("-dc"), NULL };
+	pid_t child;
+	int error = posix_spawn(&child, path.c_str(), &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (error != 0)
+		throw runtime_error("cannot decompress " + name + ": " + strerror(error));
+
+	outputWrite.reset();
+	feedRead.reset();
+
+	/* Closing the read end first makes a decompressor still writing exit on SIGPIPE, so the
+	 * wait always returns. */
+	thread feeder;
+	auto finish = [&] {
+		outputRead.reset();
+		feedWrite.reset();
+		if (feeder.joinable())
+			feeder.join();
+
+		int status;
+		while (waitpid(child, &status, 0) < 0 && errno == EINTR)
+			;
+		return status;
+	};
+
+	vector<vector<string> > ret;
+	try
+	{
+		if (contents)
+		{
+			feeder = thread(feedDecompressor, feedWrite.get(), contents);
+			feedWrite.release();
+		}
+
+		PipeBuffer buffer(outputRead.get());
+		istream in(&buffer);
+		ret = parseObs(in);
+
+		/* Drain trailing output so the decompressor can finish. */
+		in.ignore(numeric_limits<streamsize>::max());
+	}
+	catch (...)
+	{
+		finish();
+		throw;
+	}
+
+	int status = finish();
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		throw runtime_error("cannot decompress " + name + " with " + tool);
+
+	return ret;
+}
+
+
 /* Return a vector of observation sequences from a .obs file. */
 vector<vector<string> > parseObsFile(const string& filename)
 {
@@ -79,7 +295,39 @@ vector<vector<string> > parseObsFile(const string& filename)
 	if (!file.is_open())
 		throw runtime_error("file not found: " + string(filename));
 
-	int count;
+	char magic[4];
+	file.read(magic, sizeof(magic));
+
+	if (const char* tool = decompressorFor(magic, file.gcount()))
+	{
+		FileDescriptor fd(open(filename.c_str(), O_RDONLY | O_CLOEXEC));
+		if (fd.get() < 0)
+			throw runtime_error("file not found: " + string(filename));
+
+		return parseDecompressed(tool, filename, fd.get(), NULL);
+	}
+
+	file.clear();
+	file.seekg(0);
+	return parseObs(file);
+}
+
+
+/* Return a vector of observation sequences from .obs contents in memory. */
+vector<vector<string> > parseObsBuffer(const string& contents)
+{
+	if (const char* tool = decompressorFor(contents.data(), contents.size()))
+		return parseDecompressed(tool, "observation buffer", -1, &contents);
+
+	istringstream in(contents);
+	return parseObs(in);
+}
+
+
+/* Return a vector of observation sequences from a stream in .obs format. */
+vector<vector<string> > parseObs(istream& file)
+{
+	int count = 0;
 	file >> count;
 	file.ignore(numeric_limits<streamsize>::max(), '\n');
 
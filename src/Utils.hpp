@@ -1,13 +1,18 @@
 #ifndef GUARD_UTILS_HPP
 #define GUARD_UTILS_HPP
 
+#include <iosfwd>
 #include <string>
 #include <vector>
 
 /** Return a vector of this line split into space delimited words. */
 template <typename T> std::vector<T> split(const std::string& line);
-/** Return vector of observation sequences in an .obs file. */
+/** Return vector of observation sequences in an .obs file, which may be gzip or zstd compressed. */
 std::vector<std::vector<std::string> > parseObsFile(const std::string& filename);
+/** Return vector of observation sequences in the contents of an .obs file read into memory. */
+std::vector<std::vector<std::string> > parseObsBuffer(const std::string& contents);
+/** Return vector of observation sequences read from a stream in .obs format. */
+std::vector<std::vector<std::string> > parseObs(std::istream& in);
 
 
 #endif
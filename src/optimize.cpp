@@ -1,12 +1,58 @@
 #include <algorithm>
+#include <csignal>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include "HiddenMarkovMixture.hpp"
 #include "HiddenMarkovModel.hpp"
+#include "PerfCounters.hpp"
+#include "SecondOrderHiddenMarkovModel.hpp"
+#include "StateEditor.hpp"
+#include "StateSweep.hpp"
+#include "Utils.hpp"
 
 using namespace std;
 
 
 void help(char*);
+template <class Model, class Options>
+static int optimize(const string&, const string&, const string&, const Options&);
+static int cluster(const string&, const string&, const string&, size_t, unsigned long,
+				   const TrainingOptions&);
+static int sweep(const string&, const string&, const string&, SweepOptions&);
+static int grow(const string&, const string&, const string&, size_t, size_t, unsigned long,
+				const TrainingOptions&);
+
+
+static void printStats()
+{
+	reportCounters(cerr);
+}
+
+
+/* Interrupting a run stops training at the next sequence and keeps what it has learnt. */
+static CancellationToken interrupted;
+
+static void interrupt(int)
+{
+	interrupted.cancel();
+}
+
+
+static void printProgress(const Progress& progress)
+{
+	cerr << "iteration " << progress.iteration << ": " << progress.sequences << "/"
+		 << progress.totalSequences << " sequences, " << progress.sequencesPerSecond
+		 << " sequences/s, log-likelihood " << progress.logLikelihood << endl;
+}
+
+
+static void printRound(const Progress& progress)
+{
+	cerr << "round " << progress.iteration << ": " << progress.sequences << "/"
+		 << progress.totalSequences << " candidates, best held-out log-likelihood "
+		 << progress.logLikelihood << endl;
+}
 
 
 int main(int argc, char** argv)
@@ -18,13 +64,84 @@ int main(int argc, char** argv)
 	}
 
 	/* Parse arguments. We accept only one .hmm file and one .obs file. */
-	string hmmFilename, obsFilename, optHmmFilename;
+	string hmmFilename, obsFilename, optHmmFilename, validationFilename;
+	TrainingOptions options;
+	GibbsOptions gibbs;
+	bool sampling = false;
+	size_t components = 0, splits = 0, localIterations = 3;
+	SweepOptions sweeping;
+	bool sweepStates = false, iterationsGiven = false;
 
 	for (int i = 1; i < argc; ++i)
 	{
 		string arg(argv[i]);
 
-		if (arg.find(".hmm") != string::npos)
+		if (arg.find("--threads=") == 0)
+			options.execution.threads = strtoul(arg.c_str() + 10, NULL, 10);
+		else if (arg == "--pin")
+			options.execution.pin = true;
+		else if (arg == "--replicate")
+			options.execution.replicate = true;
+		else if (arg.find("--iterations=") == 0)
+		{
+			options.iterations = strtoul(arg.c_str() + 13, NULL, 10);
+			iterationsGiven = true;
+		}
+		else if (arg == "--progress")
+			options.execution.progress = printProgress;
+		else if (arg == "--deterministic")
+			options.deterministic = true;
+		else if (arg.find("--shard-size=") == 0)
+			options.shardSize = strtoul(arg.c_str() + 13, NULL, 10);
+		else if (arg.find("--validation=") == 0)
+			validationFilename = arg.substr(13);
+		else if (arg.find("--patience=") == 0)
+			options.patience = strtoul(arg.c_str() + 11, NULL, 10);
+		else if (arg.find("--gibbs=") == 0)
+		{
+			sampling = true;
+			gibbs.sweeps = strtoul(arg.c_str() + 8, NULL, 10);
+		}
+		else if (arg.find("--mixture=") == 0)
+			components = strtoul(arg.c_str() + 10, NULL, 10);
+		else if (arg.find("--sweep-states=") == 0)
+		{
+			/* MIN-MAX */
+			char* end;
+			sweepStates = true;
+			sweeping.minStates = sweeping.maxStates = strtoul(arg.c_str() + 15, &end, 10);
+			if (*end == '-')
+				sweeping.maxStates = strtoul(end + 1, NULL, 10);
+		}
+		else if (arg.find("--grow=") == 0)
+			splits = strtoul(arg.c_str() + 7, NULL, 10);
+		else if (arg.find("--local-iterations=") == 0)
+			localIterations = strtoul(arg.c_str() + 19, NULL, 10);
+		else if (arg.find("--holdout=") == 0)
+			sweeping.heldOutFraction = strtod(arg.c_str() + 10, NULL);
+		else if (arg.find("--rounds=") == 0)
+			sweeping.rounds = strtoul(arg.c_str() + 9, NULL, 10);
+		else if (arg.find("--burn-in=") == 0)
+			gibbs.burnIn = strtoul(arg.c_str() + 10, NULL, 10);
+		else if (arg.find("--thin=") == 0)
+			gibbs.thin = strtoul(arg.c_str() + 7, NULL, 10);
+		else if (arg.find("--prior=") == 0)
+			gibbs.transitionPrior = gibbs.emissionPrior = gibbs.initialPrior =
+				strtod(arg.c_str() + 8, NULL);
+		else if (arg.find("--seed=") == 0)
+			gibbs.seed = strtoul(arg.c_str() + 7, NULL, 10);
+		else if (arg.find("--checkpoint=") == 0)
+			gibbs.checkpointPrefix = arg.substr(13);
+		else if (arg == "--huge-pages=thp")
+			setHugePagePolicy(TransparentHugePages);
+		else if (arg == "--huge-pages=explicit")
+			setHugePagePolicy(ExplicitHugePages);
+		else if (arg == "--stats")
+		{
+			enableCounters(true);
+			atexit(printStats);
+		}
+		else if (arg.find(".hmm") != string::npos)
 		{
 			if (hmmFilename.empty())
 				hmmFilename = arg;
@@ -52,19 +169,227 @@ int main(int argc, char** argv)
 	}
 
 
-	HiddenMarkovModel hmm(hmmFilename);
+	options.execution.cancellation = &interrupted;
+	signal(SIGINT, interrupt);
+
+	if ((sampling || components || sweepStates || splits || !validationFilename.empty())
+		&& SecondOrderHiddenMarkovModel::isSecondOrder(hmmFilename))
+	{
+		cerr << "--gibbs, --mixture, --sweep-states, --grow and --validation need a first-order"
+			 << " model" << endl;
+		return 1;
+	}
+
+	/* The other modes hold out sequences of their own, or none at all. */
+	if (!validationFilename.empty() && (sampling || components || sweepStates || splits))
+	{
+		cerr << "--validation only works with Baum-Welch training, not with --gibbs, --mixture,"
+			 << " --sweep-states or --grow" << endl;
+		return 1;
+	}
+
+	/* Held-out sequences for early stopping of Baum-Welch. */
+	vector<vector<string> > validation;
+	if (!validationFilename.empty())
+	{
+		validation = parseObsFile(validationFilename);
+		if (validation.empty())
+		{
+			cerr << "validation file is empty" << endl;
+			return 1;
+		}
+		options.validation = &validation;
+	}
+
+	/* --iterations sets the length of a round, --seed the starting points of the candidates. */
+	if (sweepStates)
+	{
+		sweeping.execution = options.execution;
+		sweeping.seed = gibbs.seed;
+		if (iterationsGiven)
+			sweeping.roundIterations = options.iterations;
+		return sweep(hmmFilename, obsFilename, optHmmFilename, sweeping);
+	}
+
+	if (splits)
+		return grow(hmmFilename, obsFilename, optHmmFilename, splits, localIterations, gibbs.seed,
+					options);
+
+	if (components)
+		return cluster(hmmFilename, obsFilename, optHmmFilename, components, gibbs.seed, options);
+
+	/* Gibbs training shares the execution settings of Baum-Welch. */
+	if (sampling)
+	{
+		gibbs.execution = options.execution;
+		return optimize<HiddenMarkovModel>(hmmFilename, obsFilename, optHmmFilename, gibbs);
+	}
+
+	if (SecondOrderHiddenMarkovModel::isSecondOrder(hmmFilename))
+		return optimize<SecondOrderHiddenMarkovModel>(hmmFilename, obsFilename, optHmmFilename,
+													  options);
+
+	return optimize<HiddenMarkovModel>(hmmFilename, obsFilename, optHmmFilename, options);
+}
+
+
+/* Prints the likelihood of the first sequence before and after optimizing a model. */
+template <class Model, class Options>
+static int optimize(const string& hmmFilename, const string& obsFilename,
+					const string& optHmmFilename, const Options& options)
+{
+	Model hmm(hmmFilename);
 	cout << hmm.forward(obsFilename)[0];
 
-	hmm.optimized(obsFilename, optHmmFilename);
+	try
+	{
+		hmm.optimized(obsFilename, optHmmFilename, options);
+	}
+	catch (const Cancelled&)
+	{
+		cout << endl;
+		cerr << "interrupted; last completed iteration written to " << optHmmFilename << endl;
+		return 130;
+	}
 
-	HiddenMarkovModel optimized(optHmmFilename);
+	Model optimized(optHmmFilename);
 	cout << " " << optimized.forward(obsFilename)[0] << endl;
 
 	return 0;
 }
 
 
+/* Fits a mixture of components HMMs started from one model, writes them next to
+ * optHmmFilename and prints the component weights, then the component of each sequence. */
+static int cluster(const string& hmmFilename, const string& obsFilename,
+				   const string& optHmmFilename, size_t components, unsigned long seed,
+				   const TrainingOptions& options)
+{
+	HiddenMarkovModel hmm(hmmFilename);
+	vector<vector<string> > observations = parseObsFile(obsFilename);
+	if (observations.empty())
+		throw runtime_error("observation file is empty");
+
+	vector<vector<int> > corpus = hmm.intern(observations);
+	HiddenMarkovMixture mixture(hmm, components, seed);
+
+	try
+	{
+		mixture.train(corpus, options);
+	}
+	catch (const Cancelled&)
+	{
+		mixture.save(optHmmFilename);
+		cerr << "interrupted; last completed iteration written next to " << optHmmFilename << endl;
+		return 130;
+	}
+	mixture.save(optHmmFilename);
+
+	for (size_t k = 0; k < mixture.size(); ++k)
+		cout << (k ? " " : "") << mixture.weights()[k];
+	cout << endl;
+
+	for (auto k : mixture.assign(corpus, options.execution))
+		cout << k << endl;
+
+	return 0;
+}
+
+
+/* Trains candidates over a range of numbers of states, prints a line per candidate: states,
+ * iterations, training and held-out log-likelihoods, BIC, and whether it was stopped early;
+ * then writes the winner to optHmmFilename. */
+static int sweep(const string& hmmFilename, const string& obsFilename,
+				 const string& optHmmFilename, SweepOptions& options)
+{
+	HiddenMarkovModel hmm(hmmFilename);
+	vector<vector<string> > observations = parseObsFile(obsFilename);
+	if (observations.empty())
+		throw runtime_error("observation file is empty");
+
+	vector<vector<int> > corpus = hmm.intern(observations);
+	if (options.execution.progress)
+		options.execution.progress = printRound;
+	StateSweep sweep(hmm, options);
+	int status = 0;
+
+	try
+	{
+		sweep.run(corpus);
+	}
+	catch (const Cancelled&)
+	{
+		cerr << "interrupted; best candidate so far written to " << optHmmFilename << endl;
+		status = 130;
+	}
+
+	for (const auto& candidate : sweep.candidates())
+		cout << candidate.states << " " << candidate.iterations << " " << candidate.logLikelihood
+			 << " " << candidate.heldOutLogLikelihood << " " << candidate.bic
+			 << (candidate.stopped ? " stopped" : "") << endl;
+
+	if (sweep.heldOutImpossible())
+		cerr << "no candidate can produce every held-out sequence; picked the lowest BIC" << endl;
+
+	sweep.model(sweep.best()).save(optHmmFilename);
+	return status;
+}
+
+
+/* Splits the busiest state splits times, each split followed by local EM over the sequences
+ * that visit it, then runs --iterations full iterations. Prints a line per split: the split
+ * state, the new state, the number of sequences re-run and the corpus log-likelihood. */
+static int grow(const string& hmmFilename, const string& obsFilename,
+				const string& optHmmFilename, size_t splits, size_t localIterations,
+				unsigned long seed, const TrainingOptions& options)
+{
+	HiddenMarkovModel hmm(hmmFilename);
+	vector<vector<string> > observations = parseObsFile(obsFilename);
+	if (observations.empty())
+		throw runtime_error("observation file is empty");
+
+	vector<vector<int> > corpus = hmm.intern(observations);
+	int status = 0;
+
+	try
+	{
+		StateEditor editor(hmm, corpus, options, localIterations);
+		for (size_t k = 0; k < splits; ++k)
+		{
+			size_t state = editor.busiest();
+			size_t added = editor.split(state, seed + k);
+			cout << hmm.states()[state] << " " << hmm.states()[added] << " " << editor.affected()
+				 << " " << editor.logLikelihood() << endl;
+		}
+		editor.train();
+	}
+	catch (const Cancelled&)
+	{
+		cerr << "interrupted; model so far written to " << optHmmFilename << endl;
+		status = 130;
+	}
+
+	hmm.save(optHmmFilename);
+	return status;
+}
+
+
 void help(char* program)
 {
-	cout << program << ": [model.hmm] [observation.obs] [optimized_model.hmm]" << endl;
+	cout << program << ": [--iterations=N] [--validation=heldout.obs [--patience=N]] [--progress]"
+		 << " [--threads=N [--pin] [--replicate]] [--deterministic [--shard-size=N]]"
+		 << " [--huge-pages=thp|explicit] [--stats]"
+		 << " [model.hmm] [observation.obs] [optimized_model.hmm]" << endl;
+	cout << program << ": --gibbs=SWEEPS [--burn-in=N] [--thin=N] [--prior=ALPHA] [--seed=S]"
+		 << " [--checkpoint=PREFIX] [--threads=N [--pin] [--replicate]] [--progress]"
+		 << " [model.hmm] [observation.obs] [posterior_mean.hmm]" << endl;
+	cout << program << ": --mixture=K [--seed=S] [--iterations=N] [--progress]"
+		 << " [--threads=N [--pin] [--replicate]] [--deterministic [--shard-size=N]]"
+		 << " [model.hmm] [observation.obs] [components.hmm]" << endl;
+	cout << program << ": --sweep-states=MIN-MAX [--holdout=FRACTION] [--rounds=N]"
+		 << " [--iterations=N] [--seed=S] [--threads=N [--pin]] [--progress]"
+		 << " [model.hmm] [observation.obs] [best.hmm]" << endl;
+	cout << program << ": --grow=SPLITS [--local-iterations=N] [--iterations=N] [--seed=S]"
+		 << " [--threads=N [--pin] [--replicate]] [--deterministic [--shard-size=N]]"
+		 << " [model.hmm] [observation.obs] [grown.hmm]" << endl;
 }
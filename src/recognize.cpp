@@ -1,7 +1,16 @@
 #include <algorithm>
+#include <csignal>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include "CorpusReader.hpp"
 #include "HiddenMarkovModel.hpp"
+#include "MicroBatcher.hpp"
+#include "PerfCounters.hpp"
+#include "ResultFile.hpp"
+#include "SecondOrderHiddenMarkovModel.hpp"
+#include "ShmRing.hpp"
+#include "Utils.hpp"
 
 using namespace std;
 
@@ -9,6 +18,22 @@ using namespace std;
 void help(char*);
 
 
+static void printStats()
+{
+	reportCounters(cerr);
+}
+
+
+/* Ring being served, so that SIGINT can stop it cleanly and unlink the shared memory. */
+static ShmRing* servedRing = NULL;
+
+static void stopRing(int)
+{
+	if (servedRing)
+		servedRing->requestStop();
+}
+
+
 int main(int argc, char** argv)
 {
 	if (argc <= 1)
@@ -20,32 +45,161 @@ int main(int argc, char** argv)
 	/* Parse arguments. We accept only one .hmm file but allow multiple .obs files. */
 	string hmmFilename;
 	vector<string> obsFilenames;
+	bool serving = false;
+	size_t batchSize = 64;
+	long maxWait = 200;
+	string modelDirectory;
+	size_t cacheSize = 256;
+	bool asyncIO = false;
+	size_t ioDepth = 64;
+	ExecutionPolicy policy;
+	string ringName;
+	string outputFilename;
+	uint32_t ringCapacity = 1024, ringMaxLength = 4096;
 
 	for (int i = 1; i < argc; ++i)
 	{
 		string arg(argv[i]);
 
-		if (arg.find(".hmm") != string::npos)
+		if (arg == "--serve")
+			serving = true;
+		else if (arg.find("--batch-size=") == 0)
+			batchSize = strtoul(arg.c_str() + 13, NULL, 10);
+		else if (arg.find("--max-wait-us=") == 0)
+			maxWait = strtol(arg.c_str() + 14, NULL, 10);
+		else if (arg.find("--threads=") == 0)
+			policy.threads = strtoul(arg.c_str() + 10, NULL, 10);
+		else if (arg == "--pin")
+			policy.pin = true;
+		else if (arg == "--replicate")
+			policy.replicate = true;
+		else if (arg == "--huge-pages=thp")
+			setHugePagePolicy(TransparentHugePages);
+		else if (arg == "--huge-pages=explicit")
+			setHugePagePolicy(ExplicitHugePages);
+		else if (arg == "--stats")
+		{
+			enableCounters(true);
+			atexit(printStats);
+		}
+		else if (arg == "--async-io")
+			asyncIO = true;
+		else if (arg.find("--io-depth=") == 0)
+			ioDepth = strtoul(arg.c_str() + 11, NULL, 10);
+		else if (arg.find("--models=") == 0)
+			modelDirectory = arg.substr(9);
+		else if (arg.find("--cache=") == 0)
+			cacheSize = strtoul(arg.c_str() + 8, NULL, 10);
+		else if (arg.find("--output=") == 0)
+			outputFilename = arg.substr(9);
+		else if (arg.find("--ring=") == 0)
+			ringName = arg.substr(7);
+		else if (arg.find("--ring-capacity=") == 0)
+			ringCapacity = strtoul(arg.c_str() + 16, NULL, 10);
+		else if (arg.find("--ring-max-length=") == 0)
+			ringMaxLength = strtoul(arg.c_str() + 18, NULL, 10);
+		else if (arg.find(".hmm") != string::npos)
 			hmmFilename = arg;
 		else if (arg.find(".obs") != string::npos)
 			obsFilenames.push_back(arg);
 	}
 
+	/* Multi-model server mode: each line of stdin starts with the ID of the model to use. */
+	if (serving && !modelDirectory.empty())
+	{
+		ModelRegistry registry(modelDirectory, cacheSize);
+		{
+			MicroBatcher batcher(MicroBatcher::Likelihood, batchSize, maxWait, policy);
+			serve(batcher, registry, cin, cout);
+		}
+
+		printRegistryStats(registry.stats(), cerr);
+		return 0;
+	}
+
 	if (hmmFilename.empty())
 	{
 		cerr << "no .hmm file found" << endl;
 		return 1;
 	}
 
+	/* Second-order models have their own engine and only score .obs files. */
+	if (SecondOrderHiddenMarkovModel::isSecondOrder(hmmFilename))
+	{
+		if (serving || asyncIO || !ringName.empty() || !outputFilename.empty())
+		{
+			cerr << "--serve, --async-io, --ring and --output need a first-order model" << endl;
+			return 1;
+		}
+
+		SecondOrderHiddenMarkovModel hmm(hmmFilename);
+		for (auto i = obsFilenames.begin(); i != obsFilenames.end(); ++i)
+		{
+			cout << *i << ":" << endl;
+			for (auto result : hmm.forward(*i, policy))
+				cout << result << endl;
+		}
+
+		return 0;
+	}
+
+	/* Server mode: score one sequence per line of stdin, coalescing requests into batches. */
+	if (serving)
+	{
+		MicroBatcher batcher(MicroBatcher::Likelihood, batchSize, maxWait, policy);
+		serve(batcher, make_shared<HiddenMarkovModel>(hmmFilename), cin, cout);
+		return 0;
+	}
+
 	HiddenMarkovModel hmm(hmmFilename);
 
+	/* Binary results: the log-likelihoods of all sequences of all .obs files. */
+	if (!outputFilename.empty())
+	{
+		writeResults(hmm, obsFilenames, outputFilename, 0, policy);
+		return 0;
+	}
+
+	/* Read the .obs files ahead through io_uring while earlier ones are being scored. */
+	if (asyncIO)
+	{
+		CorpusReader reader(obsFilenames, ioDepth);
+		string filename, contents;
+
+		while (reader.next(filename, contents))
+		{
+			vector<vector<string> > observations = parseObsBuffer(contents);
+			if (observations.empty())
+				throw runtime_error("observation file is empty");
+
+			cout << filename << ":" << endl;
+			for (auto result : hmm.forward(hmm.intern(observations), policy))
+				cout << result << endl;
+		}
+
+		return 0;
+	}
+
+	/* Shared-memory mode: serve co-located clients through a submission/completion ring. */
+	if (!ringName.empty())
+	{
+		ShmRing ring = ShmRing::create(ringName, ringCapacity, ringMaxLength);
+		servedRing = &ring;
+		signal(SIGINT, stopRing);
+		signal(SIGTERM, stopRing);
+
+		serve(ring, hmm);
+		servedRing = NULL;
+		return 0;
+	}
+
 	/* Evaluate forward algorithm for each .obs file. Each file may have multiple sequences. */
 	for (auto i = obsFilenames.begin(); i != obsFilenames.end(); ++i)
 	{
 		cout << *i << ":" << endl;
 
 		/* Print the evaluation results for each observation in this file. */
-		for (auto result : hmm.forward(*i))
+		for (auto result : hmm.forward(*i, policy))
 			cout << result << endl;
 	}
 
@@ -55,5 +209,13 @@ int main(int argc, char** argv)
 
 void help(char* program)
 {
-	cout << program << ": [model.hmm] [observation.obs ...]" << endl;
+	cout << program << ": [--threads=N [--pin] [--replicate]] [--huge-pages=thp|explicit]"
+		 << " [--async-io [--io-depth=N]] [--output=results.bin] [--stats]"
+		 << " [model.hmm] [observation.obs ...]" << endl;
+	cout << program << ": --serve [--threads=N [--pin] [--replicate]] [--batch-size=N]"
+		 << " [--max-wait-us=U] [model.hmm]" << endl;
+	cout << program << ": --serve --models=DIR [--cache=N] [--threads=N [--pin] [--replicate]]"
+		 << " [--batch-size=N] [--max-wait-us=U]" << endl;
+	cout << program << ": --ring=/name [--ring-capacity=N] [--ring-max-length=L] [model.hmm]"
+		 << " (one client per ring; the ring must not exist yet)" << endl;
 }
@@ -1,6 +1,14 @@
 #include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <stdexcept>
+#include "CorpusReader.hpp"
 #include "HiddenMarkovModel.hpp"
+#include "MicroBatcher.hpp"
+#include "PerfCounters.hpp"
+#include "ResultFile.hpp"
+#include "SecondOrderHiddenMarkovModel.hpp"
+#include "Utils.hpp"
 
 using namespace std;
 
@@ -8,6 +16,98 @@ using namespace std;
 void help(char*);
 
 
+static void printStats()
+{
+	reportCounters(cerr);
+}
+
+
+/* Prints the entropy of the state paths of a sequence, then each posterior decoded state
+ * with its posterior probability and marginal entropy. */
+static void printPosterior(const HiddenMarkovModel& hmm, const PosteriorDecoding& result)
+{
+	cout << result.pathEntropy;
+	for (size_t t = 0; t < result.path.size(); ++t)
+	{
+		cout << " " << hmm.states()[result.path[t]] << ":" << result.confidence[t] << ":"
+			 << result.entropy[t];
+	}
+}
+
+
+/* Prints one line per sequence with the requested decoding. Posterior lines start with the
+ * sequence probability; fused lines hold the sequence probability, the Viterbi path with its
+ * probability and, with posteriors, the posterior decoding after a "|". */
+static void printDecodings(const HiddenMarkovModel& hmm, const vector<vector<int> >& batch,
+						   bool fused, bool confidence, const ExecutionPolicy& policy)
+{
+	if (!fused)
+	{
+		for (auto& result : hmm.posterior(batch, policy))
+		{
+			cout << exp(result.logLikelihood) << " ";
+			printPosterior(hmm, result);
+			cout << endl;
+		}
+		return;
+	}
+
+	for (auto& result : hmm.query(batch, confidence, policy))
+	{
+		cout << exp(result.logLikelihood) << " " << exp(result.pathLogProbability);
+		for (auto stt : result.path)
+			cout << " " << hmm.states()[stt];
+
+		if (confidence)
+		{
+			cout << " | ";
+			printPosterior(hmm, result.posterior);
+		}
+		cout << endl;
+	}
+}
+
+
+/* Prints count sampled state paths for each sequence, one per line with the joint probability
+ * of the path and the sequence, as for Viterbi paths. */
+static void printSamples(const HiddenMarkovModel& hmm, const vector<vector<int> >& batch,
+						 size_t count, unsigned long seed, const ExecutionPolicy& policy)
+{
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		vector<vector<int> > paths = hmm.sample(batch[i], count, seed + i, policy);
+		vector<double> scores = hmm.scorePaths(batch[i], paths);
+
+		for (size_t k = 0; k < paths.size(); ++k)
+		{
+			cout << exp(scores[k]);
+			for (auto stt : paths[k])
+				cout << " " << hmm.states()[stt];
+			cout << endl;
+		}
+	}
+}
+
+
+/* Prints one line per sequence with the log probability of its Viterbi path, then each run of
+ * one state on the path as STATE:START:END:SCORE over positions [START, END), with the log
+ * probability the path accrues over the run. */
+static void printSegments(const HiddenMarkovModel& hmm, const vector<vector<int> >& batch,
+						  const ExecutionPolicy& policy)
+{
+	for (auto& result : hmm.segments(batch, policy))
+	{
+		cout << result.first;
+		for (auto& run : result.second)
+		{
+			cout << " " << hmm.states()[run.state] << ":" << run.start << ":" << run.end << ":"
+				 << run.score;
+		}
+		cout << endl;
+	}
+}
+
+
 int main(int argc, char** argv)
 {
 	if (argc <= 1)
@@ -19,32 +119,201 @@ int main(int argc, char** argv)
 	/* Parse arguments. We accept only one .hmm file but allow multiple .obs files. */
 	string hmmFilename;
 	vector<string> obsFilenames;
+	bool serving = false;
+	size_t batchSize = 64;
+	long maxWait = 200;
+	string modelDirectory;
+	size_t cacheSize = 256;
+	bool asyncIO = false;
+	bool confidence = false;
+	bool fused = false;
+	bool segments = false;
+	size_t samples = 0;
+	unsigned long seed = 0;
+	size_t ioDepth = 64;
+	string outputFilename;
+	ExecutionPolicy policy;
 
 	for (int i = 1; i < argc; ++i)
 	{
 		string arg(argv[i]);
 
-		if (arg.find(".hmm") != string::npos)
+		if (arg == "--serve")
+			serving = true;
+		else if (arg.find("--batch-size=") == 0)
+			batchSize = strtoul(arg.c_str() + 13, NULL, 10);
+		else if (arg.find("--max-wait-us=") == 0)
+			maxWait = strtol(arg.c_str() + 14, NULL, 10);
+		else if (arg.find("--threads=") == 0)
+			policy.threads = strtoul(arg.c_str() + 10, NULL, 10);
+		else if (arg == "--pin")
+			policy.pin = true;
+		else if (arg == "--replicate")
+			policy.replicate = true;
+		else if (arg == "--huge-pages=thp")
+			setHugePagePolicy(TransparentHugePages);
+		else if (arg == "--huge-pages=explicit")
+			setHugePagePolicy(ExplicitHugePages);
+		else if (arg == "--stats")
+		{
+			enableCounters(true);
+			atexit(printStats);
+		}
+		else if (arg == "--confidence")
+			confidence = true;
+		else if (arg == "--fused")
+			fused = true;
+		else if (arg == "--segments")
+			segments = true;
+		else if (arg.find("--samples=") == 0)
+			samples = strtoul(arg.c_str() + 10, NULL, 10);
+		else if (arg.find("--seed=") == 0)
+			seed = strtoul(arg.c_str() + 7, NULL, 10);
+		else if (arg == "--async-io")
+			asyncIO = true;
+		else if (arg.find("--io-depth=") == 0)
+			ioDepth = strtoul(arg.c_str() + 11, NULL, 10);
+		else if (arg.find("--output=") == 0)
+			outputFilename = arg.substr(9);
+		else if (arg.find("--models=") == 0)
+			modelDirectory = arg.substr(9);
+		else if (arg.find("--cache=") == 0)
+			cacheSize = strtoul(arg.c_str() + 8, NULL, 10);
+		else if (arg.find(".hmm") != string::npos)
 			hmmFilename = arg;
 		else if (arg.find(".obs") != string::npos)
 			obsFilenames.push_back(arg);
 	}
 
+	/* Multi-model server mode: each line of stdin starts with the ID of the model to use. */
+	if (serving && !modelDirectory.empty())
+	{
+		ModelRegistry registry(modelDirectory, cacheSize);
+		{
+			MicroBatcher batcher(MicroBatcher::StatePath, batchSize, maxWait, policy);
+			serve(batcher, registry, cin, cout);
+		}
+
+		printRegistryStats(registry.stats(), cerr);
+		return 0;
+	}
+
 	if (hmmFilename.empty())
 	{
 		cerr << "no .hmm file found" << endl;
 		return 1;
 	}
 
+	/* Second-order models have their own engine and only decode .obs files. */
+	if (SecondOrderHiddenMarkovModel::isSecondOrder(hmmFilename))
+	{
+		if (serving || asyncIO || confidence || fused || samples || segments
+			|| !outputFilename.empty())
+		{
+			cerr << "--serve, --async-io, --confidence, --fused, --samples, --segments and"
+				 << " --output need a first-order model" << endl;
+			return 1;
+		}
+
+		SecondOrderHiddenMarkovModel hmm(hmmFilename);
+		for (auto i = obsFilenames.begin(); i != obsFilenames.end(); ++i)
+		{
+			cout << *i << ":" << endl;
+			for (auto result : hmm.viterbi(*i, policy))
+			{
+				cout << result.first;
+				for (auto& stt : result.second)
+					cout << " " << stt;
+				cout << endl;
+			}
+		}
+
+		return 0;
+	}
+
+	/* Server mode: score one sequence per line of stdin, coalescing requests into batches. */
+	if (serving)
+	{
+		MicroBatcher batcher(MicroBatcher::StatePath, batchSize, maxWait, policy);
+		serve(batcher, make_shared<HiddenMarkovModel>(hmmFilename), cin, cout);
+		return 0;
+	}
+
 	HiddenMarkovModel hmm(hmmFilename);
 
+	/* Binary results: log-likelihoods and Viterbi paths, with --confidence also the state
+	 * posteriors, of all sequences of all .obs files. */
+	if (!outputFilename.empty())
+	{
+		unsigned columns = ResultWriter::Paths | (confidence ? ResultWriter::Posteriors : 0);
+		writeResults(hmm, obsFilenames, outputFilename, columns, policy);
+		return 0;
+	}
+
+	/* Read the .obs files ahead through io_uring while earlier ones are being scored. */
+	if (asyncIO)
+	{
+		CorpusReader reader(obsFilenames, ioDepth);
+		string filename, contents;
+
+		while (reader.next(filename, contents))
+		{
+			vector<vector<string> > observations = parseObsBuffer(contents);
+			if (observations.empty())
+				throw runtime_error("observation file is empty");
+
+			cout << filename << ":" << endl;
+			if (samples)
+			{
+				printSamples(hmm, hmm.intern(observations), samples, seed, policy);
+				continue;
+			}
+			if (segments)
+			{
+				printSegments(hmm, hmm.intern(observations), policy);
+				continue;
+			}
+			if (confidence || fused)
+			{
+				printDecodings(hmm, hmm.intern(observations), fused, confidence, policy);
+				continue;
+			}
+
+			for (auto result : hmm.viterbi(hmm.intern(observations), policy))
+			{
+				cout << result.first;
+				for (auto stt : result.second)
+					cout << " " << hmm.states()[stt];
+				cout << endl;
+			}
+		}
+
+		return 0;
+	}
+
 	/* Evaluate Viterbi algorithm for each .obs file. Each file may have multiple sequences. */
 	for (auto i = obsFilenames.begin(); i != obsFilenames.end(); ++i)
 	{
 		cout << *i << ":" << endl;
 
+		/* Posterior decoding, fused queries, path samples or segments, parsing the file once. */
+		if (confidence || fused || samples || segments)
+		{
+			vector<vector<string> > observations = parseObsFile(*i);
+			if (observations.empty())
+				throw runtime_error("observation file is empty");
+
+			if (samples)
+				printSamples(hmm, hmm.intern(observations), samples, seed, policy);
+			else if (segments)
+				printSegments(hmm, hmm.intern(observations), policy);
+			else
+				printDecodings(hmm, hmm.intern(observations), fused, confidence, policy);
+			continue;
+		}
+
 		/* Print the statepath results for each observation in this file. */
-		for (auto result : hmm.viterbi(*i))
+		for (auto result : hmm.viterbi(*i, policy))
 		{
 			cout << result.first;
 
@@ -61,5 +330,12 @@ int main(int argc, char** argv)
 
 void help(char* program)
 {
-	cout << program << ": [model.hmm] [observation.obs ...]" << endl;
+	cout << program << ": [--threads=N [--pin] [--replicate]] [--huge-pages=thp|explicit]"
+		 << " [--async-io [--io-depth=N]] [--stats] [--confidence] [--fused]"
+		 << " [--samples=K [--seed=S]] [--segments] [--output=results.bin]"
+		 << " [model.hmm] [observation.obs ...]" << endl;
+	cout << program << ": --serve [--threads=N [--pin] [--replicate]] [--batch-size=N]"
+		 << " [--max-wait-us=U] [model.hmm]" << endl;
+	cout << program << ": --serve --models=DIR [--cache=N] [--threads=N [--pin] [--replicate]]"
+		 << " [--batch-size=N] [--max-wait-us=U]" << endl;
 }